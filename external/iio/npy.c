@@ -360,20 +360,51 @@ static void convert_datum(void *dest, void *src, int dest_fmt, int src_fmt)
 #undef F8
 #undef F6
 
-float* npy_convert_to_float(void* src, int n, int src_fmt)
+int npy_type_is_float(int type)
+{
+	return normalize_type(type) == IIO_TYPE_FLOAT;
+}
+
+int npy_type_is_uint8(int type)
+{
+	return normalize_type(type) == IIO_TYPE_UINT8;
+}
+
+int npy_type_is_uint16(int type)
+{
+	return normalize_type(type) == IIO_TYPE_UINT16;
+}
+
+void npy_type_describe(int type, int* size, int* is_float, int* is_signed)
+{
+	bool ieefp, signedness;
+	iio_type_unid(size, &ieefp, &signedness, type);
+	*is_float = ieefp;
+	*is_signed = signedness;
+}
+
+void npy_convert_into_float(float* dest, const void* src, size_t n, int src_fmt)
 {
 	int dest_fmt = IIO_TYPE_FLOAT;
 	src_fmt = normalize_type(src_fmt);
-	if (src_fmt == dest_fmt) return src;
 	size_t src_width = iio_type_size(src_fmt);
 	size_t dest_width = iio_type_size(dest_fmt);
-	char *r = malloc(n * dest_width);
-	for (int i = 0; i < n; i++) {
-		void *to   = i * dest_width + r;
+	if (src_fmt == dest_fmt) {
+		memcpy(dest, src, n * dest_width);
+		return;
+	}
+	for (size_t i = 0; i < n; i++) {
+		void *to   = i * dest_width + (char *)dest;
 		void *from = i * src_width  + (char *)src;
 		convert_datum(to, from, dest_fmt, src_fmt);
 	}
-	free(src);
-	return (float*) r;
 }
 
+float* npy_convert_to_float(void* src, int n, int src_fmt)
+{
+	if (npy_type_is_float(src_fmt)) return src;
+	float *r = malloc(n * sizeof(float));
+	npy_convert_into_float(r, src, n, src_fmt);
+	free(src);
+	return r;
+}
@@ -13,5 +13,12 @@ struct npy_info {
 
 int npy_read_header(FILE *fin, struct npy_info* ni);
 size_t npy_type_size(int type);
+int npy_type_is_float(int type);
+int npy_type_is_uint8(int type);
+int npy_type_is_uint16(int type);
+// size in bytes of the samples, and whether they are floats or signed integers
+void npy_type_describe(int type, int* size, int* is_float, int* is_signed);
 float* npy_convert_to_float(void* src, int n, int src_fmt);
+// converts n samples without taking ownership of src
+void npy_convert_into_float(float* dest, const void* src, size_t n, int src_fmt);
 
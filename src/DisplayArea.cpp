@@ -7,8 +7,10 @@
 #include "Colormap.hpp"
 #include "View.hpp"
 #include "Image.hpp"
+#include "ImagePyramid.hpp"
 #include "DisplayArea.hpp"
 #include "shaders.hpp"
+#include "globals.hpp"
 
 #define S(...) #__VA_ARGS__
 
@@ -36,7 +38,8 @@ static std::string checkerboardFragment = S(
 #endif
 
 void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 winSize,
-                       const Colormap* colormap, const View* view, float factor)
+                       const Colormap* colormap, const View* view, float factor,
+                       const std::shared_ptr<Image>& preview, ImVec2 previewSize)
 {
     static Shader* checkerboard = createShader(checkerboardFragment);
 
@@ -45,7 +48,11 @@ void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 w
         ImVec2 imSize(image->w, image->h);
         ImVec2 p1 = view->window2image(ImVec2(0, 0), imSize, winSize, factor);
         ImVec2 p2 = view->window2image(winSize, imSize, winSize, factor);
-        requestTextureArea(image, ImRect(p1, p2));
+        requestTextureArea(image, ImRect(p1, p2), (p1 + p2) / 2, view->zoom * factor);
+    } else if (preview) {
+        ImVec2 p1 = view->window2image(ImVec2(0, 0), previewSize, winSize, factor);
+        ImVec2 p2 = view->window2image(winSize, previewSize, winSize, factor);
+        requestPreviewArea(preview, previewSize, ImRect(p1, p2), (p1 + p2) / 2);
     }
 
     // draw a checkboard pattern
@@ -59,15 +66,37 @@ void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 w
         ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, NULL);
     }
 
+    // the previous image stays displayed while the texture of the new one is uploaded
+    std::shared_ptr<Texture> shown = texture && texture->isDisplayable() ? texture : previous;
+    if (!shown)
+        return;
+
     // display the texture
     ImGui::ShaderUserData* userdata = new ImGui::ShaderUserData;
     userdata->shader = colormap->shader;
     userdata->scale = colormap->getScale();
     userdata->bias = colormap->getBias();
+    // the texels of integer images are normalized to [0,1]
+    for (auto& s : userdata->scale) {
+        s *= shown->normalization;
+    }
     ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, userdata);
-    for (auto t : texture.tiles) {
-        ImVec2 TL = view->image2window(ImVec2(t.x, t.y), getCurrentSize(), winSize, factor);
-        ImVec2 BR = view->image2window(ImVec2(t.x+t.w, t.y+t.h), getCurrentSize(), winSize, factor);
+    // the tiles that are not filled yet let the checkerboard through
+    for (auto& it : shown->tiles) {
+        const TextureTile& t = it.second;
+        if (!t.ready) continue;
+
+        // the texels of a reduced level cover several pixels, the last ones go past the image
+        // the rows that a partially decoded image does not have yet are not drawn
+        float s = shown->scale;
+        ImVec2 from = ImVec2(t.x, t.y) * s;
+        ImVec2 limit = ImMin(shown->displaySize, ImVec2(shown->displaySize.x, shown->validRows * s));
+        ImVec2 to = ImMin(ImVec2(t.x+t.w, t.y+t.h) * s, limit);
+        if (to.y <= from.y) continue;
+        ImVec2 uv = (to - from) / (ImVec2(t.w, t.h) * s);
+
+        ImVec2 TL = view->image2window(from, shown->displaySize, winSize, factor);
+        ImVec2 BR = view->image2window(to, shown->displaySize, winSize, factor);
 
         TL += pos;
         BR += pos;
@@ -77,35 +106,65 @@ void DisplayArea::draw(const std::shared_ptr<Image>& image, ImVec2 pos, ImVec2 w
         if (TL.y > pos.y + winSize.y) continue;
         if (BR.y < pos.y) continue;
 
-        ImGui::GetWindowDrawList()->AddImage((void*)(size_t)t.id, TL, BR);
+        ImGui::GetWindowDrawList()->AddImage((void*)(size_t)t.id, TL, BR, ImVec2(0, 0), uv);
     }
     ImGui::GetWindowDrawList()->AddCallback(ImGui::SetShaderCallback, NULL);
 }
 
-void DisplayArea::requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect)
+void DisplayArea::requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect, ImVec2 focus, float zoom)
 {
-    rect.Expand(1.0f);
-    rect.Floor();
-    rect.ClipWithFull(ImRect(0, 0, image->w, image->h));
-
-    bool reupload = false;
+    // when zoomed out, a reduced level of a large image is displayed instead
+    // (not for the nearest neighbor downsampling, the levels are averages,
+    // except for tiled images that would otherwise read every block)
+    std::shared_ptr<Image> level;
+    float scale = 1.f;
+    if (image->pyramid && (gDownsamplingQuality >= 1 || image->isTiled())) {
+        level = image->pyramid->getLevel(zoom, scale);
+    }
+    if (!level) {
+        level = image;
+        scale = 1.f;
+    }
 
-    if (this->image != image) {
+    if (!texture || texture->image.lock() != level || this->image != image) {
+        // the latest image is taken when the current one is uploaded,
+        // unless the current one is already displayed partially, it is then abandoned
+        if (texture && texture->isUploading() && !texture->isProgressive())
+            return;
+
+        // the texture is shared with the other windows that display the image
+        if (texture && texture->isDisplayable()) {
+            previous = texture;
+        }
+        texture = Texture::get(level, scale, image->size);
         this->image = image;
-        loadedRect = ImRect();
-        reupload = true;
     }
 
-    if (!loadedRect.Contains(rect)) {
-        loadedRect.Add(rect);
-        loadedRect.Expand(128);  // to avoid multiple uploads during zoom-out
-        loadedRect.ClipWithFull(ImRect(0, 0, image->w, image->h));
-        reupload = true;
+    if (texture->isDisplayable()) {
+        previous = nullptr;
+    }
+    texture->request(rect, focus);
+}
+
+// the texels of the preview cover several pixels of the image, as for a reduced level
+void DisplayArea::requestPreviewArea(const std::shared_ptr<Image>& preview, ImVec2 size, ImRect rect, ImVec2 focus)
+{
+    if (!texture || texture->image.lock() != preview) {
+        if (texture && texture->isUploading() && !texture->isProgressive())
+            return;
+
+        if (texture && texture->isDisplayable()) {
+            previous = texture;
+        }
+        texture = Texture::get(preview, size.x / preview->w, size);
+        image = nullptr;
+        previewSize = size;
     }
 
-    if (reupload) {
-        texture.upload(image, loadedRect);
+    if (texture->isDisplayable()) {
+        previous = nullptr;
     }
+    texture->request(rect, focus);
 }
 
 ImVec2 DisplayArea::getCurrentSize() const
@@ -113,6 +172,6 @@ ImVec2 DisplayArea::getCurrentSize() const
     if (image) {
         return ImVec2(image->w, image->h);
     }
-    return ImVec2();
+    return previewSize;
 }
 
@@ -10,18 +10,25 @@ struct View;
 struct Sequence;
 
 class DisplayArea {
-    Texture texture;
+    std::shared_ptr<Texture> texture;
+    // texture of the previous image, displayed until the current one is
+    std::shared_ptr<Texture> previous;
 
     std::shared_ptr<Image> image;
-    ImRect loadedRect;
+    // size of the image that the displayed preview stands for
+    ImVec2 previewSize;
 
 public:
     DisplayArea() : image(nullptr) {
     }
 
+    // 'preview' is displayed in place of an image of size 'previewSize' while 'image' is null
     void draw(const std::shared_ptr<Image>& image, ImVec2 pos,
-              ImVec2 winSize, const Colormap* colormap, const View* view, float factor);
-    void requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect);
+              ImVec2 winSize, const Colormap* colormap, const View* view, float factor,
+              const std::shared_ptr<Image>& preview=nullptr, ImVec2 previewSize=ImVec2());
+    // 'zoom' is the size of a pixel of the image on the screen
+    void requestTextureArea(const std::shared_ptr<Image>& image, ImRect rect, ImVec2 focus, float zoom);
+    void requestPreviewArea(const std::shared_ptr<Image>& preview, ImVec2 size, ImRect rect, ImVec2 focus);
     ImVec2 getCurrentSize() const;
 
 };
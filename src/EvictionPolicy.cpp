@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <limits>
+
+#include "Sequence.hpp"
+#include "Player.hpp"
+#include "ImageCollection.hpp"
+#include "globals.hpp"
+#include "EvictionPolicy.hpp"
+
+static std::vector<std::pair<std::shared_ptr<ImageCollection>, int>> getIndexableCollections()
+{
+    std::vector<std::pair<std::shared_ptr<ImageCollection>, int>> collections;
+    for (auto seq : gSequences) {
+        if (!seq->player)
+            continue;
+        if (seq->collection)
+            collections.push_back(std::make_pair(seq->collection, seq->collection->getLength()));
+        if (seq->uneditedCollection && seq->uneditedCollection != seq->collection)
+            collections.push_back(std::make_pair(seq->uneditedCollection, seq->uneditedCollection->getLength()));
+    }
+    return collections;
+}
+
+void PlaybackEvictionPolicy::rebuildIndex(const std::list<std::string>& lru)
+{
+    slots.clear();
+    keys.clear();
+    for (auto& c : indexed) {
+        std::vector<std::string>& k = keys[c.first.get()];
+        k.resize(c.second);
+        for (int i = 0; i < c.second; i++) {
+            k[i] = c.first->getKey(i);
+            slots[k[i]].push_back(Slot{c.first.get(), i});
+        }
+    }
+
+    cached.clear();
+    for (auto& key : lru) {
+        onStore(key);
+    }
+}
+
+// runs on the main thread, which owns the sequences and the players
+void PlaybackEvictionPolicy::onFrame(const std::list<std::string>& lru)
+{
+    auto collections = getIndexableCollections();
+    if (collections != indexed) {
+        indexed = collections;
+        rebuildIndex(lru);
+    }
+
+    playheads.clear();
+    for (auto seq : gSequences) {
+        const Player* player = seq->player;
+        if (!player)
+            continue;
+        std::vector<std::shared_ptr<ImageCollection>> collections = {seq->collection};
+        if (seq->uneditedCollection != seq->collection)
+            collections.push_back(seq->uneditedCollection);
+        for (auto& collection : collections) {
+            if (!collection)
+                continue;
+            Playhead playhead;
+            playhead.collection = collection.get();
+            playhead.frame = player->frame - 1;
+            playhead.lo = std::max(player->currentMinFrame, 1) - 1;
+            playhead.hi = std::min(player->currentMaxFrame, collection->getLength()) - 1;
+            playhead.direction = player->fps >= 0 ? 1 : -1;
+            playhead.looping = player->looping;
+            playheads.push_back(playhead);
+        }
+    }
+}
+
+// distance (in frames) before the player shows the image
+// images outside of the loop bounds or behind a non-looping player get the largest distances
+bool PlaybackEvictionPolicy::score(const Playhead& playhead, int index, long& distance) const
+{
+    int lo = playhead.lo;
+    int hi = playhead.hi;
+    if (lo > hi)
+        return false;
+
+    long span = hi - lo + 1;
+    if (index < lo || index > hi) {
+        distance = 2 * span + (index < lo ? lo - index : index - hi);
+        return true;
+    }
+
+    long d = (long) (index - playhead.frame) * playhead.direction;
+    if (playhead.looping) {
+        d = ((d % span) + span) % span;
+    } else if (d < 0) {
+        d = span - d;
+    }
+    distance = d;
+    return true;
+}
+
+bool PlaybackEvictionPolicy::score(const std::string& key, long& distance) const
+{
+    auto it = slots.find(key);
+    if (it == slots.end())
+        return false;
+
+    bool found = false;
+    distance = std::numeric_limits<long>::max();
+    for (auto& slot : it->second) {
+        for (auto& playhead : playheads) {
+            if (playhead.collection != slot.collection)
+                continue;
+            long d;
+            if (score(playhead, slot.index, d)) {
+                distance = std::min(distance, d);
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+void PlaybackEvictionPolicy::onStore(const std::string& key)
+{
+    auto it = slots.find(key);
+    if (it == slots.end())
+        return;
+    for (auto& slot : it->second) {
+        cached[slot.collection].insert(slot.index);
+    }
+}
+
+void PlaybackEvictionPolicy::onRemove(const std::string& key)
+{
+    auto it = slots.find(key);
+    if (it == slots.end())
+        return;
+    for (auto& slot : it->second) {
+        cached[slot.collection].erase(slot.index);
+    }
+}
+
+void PlaybackEvictionPolicy::onFlush()
+{
+    cached.clear();
+}
+
+// runs on the loading threads, only reads the snapshot taken by onFrame()
+std::string PlaybackEvictionPolicy::selectVictim(const std::string& incoming, const std::list<std::string>& lru)
+{
+    // for each player, the farthest cached frame is either at one end of the set
+    // or right next to the playhead (depending on the direction and on looping)
+    std::string victim;
+    long farthest = window;
+    for (auto& playhead : playheads) {
+        auto it = cached.find(playhead.collection);
+        auto k = keys.find(playhead.collection);
+        if (it == cached.end() || it->second.empty() || k == keys.end())
+            continue;
+        const std::set<int>& indices = it->second;
+
+        int current = playhead.frame;
+        std::vector<int> candidates = {*indices.begin(), *indices.rbegin()};
+        auto next = indices.upper_bound(current);
+        if (next != indices.end())
+            candidates.push_back(*next);
+        auto prev = indices.lower_bound(current);
+        if (prev != indices.begin())
+            candidates.push_back(*std::prev(prev));
+
+        for (int index : candidates) {
+            const std::string& key = k->second[index];
+            long d;
+            if (score(key, d) && d > farthest) {
+                farthest = d;
+                victim = key;
+            }
+        }
+    }
+
+    long d;
+    bool tracked = score(incoming, d);
+    if (victim.empty()) {
+        // all the cached frames are about to be shown: a frame needed after them is refused,
+        // the other images (blocks of tiled images, frames of no player) replace the least recently used
+        if (tracked && d >= farthest)
+            return "";
+        return lru.back();
+    }
+
+    // the images that are not frames go first only if they were used before the victim
+    for (auto it = lru.rbegin(); it != lru.rend() && *it != victim; ++it) {
+        if (slots.find(*it) == slots.end())
+            return *it;
+    }
+
+    if (tracked && d >= farthest) {
+        // the new image would be needed after all the cached ones
+        return "";
+    }
+    return victim;
+}
+
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include "ImageCache.hpp"
+
+class ImageCollection;
+
+// evicts the least recently used image
+class LRUEvictionPolicy : public ImageCache::EvictionPolicy {
+public:
+    std::string selectVictim(const std::string& incoming, const std::list<std::string>& lru) {
+        return lru.back();
+    }
+};
+
+// evicts the frame that the players will need last, according to their
+// current frame, direction (sign of fps) and loop bounds
+// the images that are not frames of a player (eg. blocks of tiled images) are evicted in LRU order,
+// before the frame to evict only if they were used less recently
+// the 'window' frames following the playhead are kept, unless such an image needs their room
+class PlaybackEvictionPolicy : public ImageCache::EvictionPolicy {
+    struct Slot {
+        const ImageCollection* collection;
+        int index;
+    };
+
+    // state of a player for one of its collections, copied from the main thread by onFrame()
+    struct Playhead {
+        const ImageCollection* collection;
+        // current frame and loop bounds, from 0 and clamped to the collection
+        int frame;
+        int lo, hi;
+        int direction;
+        bool looping;
+    };
+
+    int window;
+
+    // the indexed collections are kept alive so that their addresses identify them
+    std::vector<std::pair<std::shared_ptr<ImageCollection>, int>> indexed;
+    // key -> position of the key in the collections of the sequences
+    std::unordered_map<std::string, std::vector<Slot>> slots;
+    // keys of the frames of each indexed collection
+    std::map<const ImageCollection*, std::vector<std::string>> keys;
+    // indices of the cached images for each collection
+    std::map<const ImageCollection*, std::set<int>> cached;
+    std::vector<Playhead> playheads;
+
+    void rebuildIndex(const std::list<std::string>& lru);
+    bool score(const Playhead& playhead, int index, long& distance) const;
+    bool score(const std::string& key, long& distance) const;
+
+public:
+    PlaybackEvictionPolicy(int window=16) : window(window) {
+    }
+
+    void onStore(const std::string& key);
+    void onRemove(const std::string& key);
+    void onFlush();
+    void onFrame(const std::list<std::string>& lru);
+
+    std::string selectVictim(const std::string& incoming, const std::list<std::string>& lru);
+};
+
@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+
 #include "imgui.h"
 #define IMGUI_DEFINE_MATH_OPERATORS
 #include "imgui_internal.h"
@@ -7,83 +12,61 @@
 #include "Image.hpp"
 #include "globals.hpp"
 #include "Histogram.hpp"
+#include "HistogramIndex.hpp"
+#include "LoadingThread.hpp"
 
 namespace imscript {
-    // a quad is a square cell bounded by 4 pixels
-    // it knows its four values and its position on the original image
-    struct quad {
-        float abcd[4];
-        int ij;
-    };
-
-    static int compare_floats(const void *a, const void *b)
-    {
-        const float *da = (const float *) a;
-        const float *db = (const float *) b;
-        return (*da > *db) - (*da < *db);
-    }
-
-    static void sort_four_values(float *x)
+    // sorting network for the four values of a cell
+    static inline void sort_four_values(float *x)
     {
-        qsort(x, 4, sizeof*x, compare_floats);
-    }
-
-    // copy the values of a square cell into an array, for easy access
-    static void copy_cell_values(float q[4], float *x, int w, int h, int c, int i, int j)
-    {
-        assert(0 <= i); assert(i < w - 1);
-        assert(0 <= j); assert(j < h - 1);
-        q[0] = x[ ((j+0)*w + (i+0))*c ];
-        q[1] = x[ ((j+0)*w + (i+1))*c ];
-        q[2] = x[ ((j+1)*w + (i+0))*c ];
-        q[3] = x[ ((j+1)*w + (i+1))*c ];
+        float a = std::min(x[0], x[1]);
+        float b = std::max(x[0], x[1]);
+        float c = std::min(x[2], x[3]);
+        float d = std::max(x[2], x[3]);
+        float e = std::max(a, c);
+        float f = std::min(b, d);
+        x[0] = std::min(a, c);
+        x[1] = std::min(e, f);
+        x[2] = std::max(e, f);
+        x[3] = std::max(b, d);
     }
 
     // obtain the histogram bin that corresponds to the given value
-    static int bin(int n, float m, float M, float x)
+    // 's' is (n - 1) / (M - m)
+    static int bin(int n, float m, float s, float x)
     {
-        float f = (n - 1) * (x - m) / (M - m);
-        int r = lrint(f);
-        assert(m <= x); assert(x <= M); assert(0 <= r); assert(r < n);
+        int r = lrintf((x - m) * s);
+        assert(0 <= r); assert(r < n);
         return r;
     }
 
+    // written so that non-finite values make the cell degenerate
     static int cell_is_degenerate(float m, float M, float q[4])
     {
-        for (int i = 0; i < 4; i++)
-            if (q[i] < m || q[i] > M)
-                return 1;
-        return !(q[0] < q[1] && q[1] < q[2] && q[2] < q[3]);
+        return !(m <= q[0] && q[0] < q[1] && q[1] < q[2] && q[2] < q[3] && q[3] <= M);
     }
 
-    static void integrate_values(long double (*o)[2], int n)
+    static void integrate_values(double *o, int n)
     {
         // TODO : multiply each increment by the span of the interval
         for (int i = 1; i < n; i++)
-            o[i][1] += o[i-1][1];// * (o[i][0] - o[i-1][0]);
-        //o[0][1] = 0;
+            o[i] += o[i-1];
     }
 
-    static void accumulate_jumps_for_one_cell(long double (*o)[2],
-                                              int n, float m, float M, float q[4])
+    // 'T' is the type of the accumulators, float for speed or double for precision
+    template <typename T>
+    static void accumulate_jumps_for_one_cell(T *o,
+                                              int n, float m, float M, float s, float q[4])
     {
         // discard degenerate cells
         if (cell_is_degenerate(m, M, q))
             return;
 
         // give nice names to numbers
-        float A = q[0];
-        float B = q[1];
-        float C = q[2];
-        float D = q[3];
-        int i_A = bin(n, m, M, A);
-        int i_B = bin(n, m, M, B);
-        int i_C = bin(n, m, M, C);
-        int i_D = bin(n, m, M, D);
-        A = i_A;
-        B = i_B;
-        C = i_C;
-        D = i_D;
+        int i_A = bin(n, m, s, q[0]);
+        int i_B = bin(n, m, s, q[1]);
+        int i_C = bin(n, m, s, q[2]);
+        int i_D = bin(n, m, s, q[3]);
 
         if (i_A == i_B || i_B == i_C || i_C == i_D) return;
 
@@ -91,44 +74,31 @@ namespace imscript {
         assert(i_B < i_C);
         assert(i_C < i_D);
 
-        double fac = 1;//33333;
+        T A = i_A;
+        T B = i_B;
+        T C = i_C;
+        T D = i_D;
+        T fac = 2 / (C + D - B - A);
 
         // accumulate jumps
-        o[ i_A ][1] += fac * 2 / (C + D - B - A) / (B - A);
-        o[ i_B ][1] -= fac * 2 / (C + D - B - A) / (B - A);
-        o[ i_C ][1] -= fac * 2 / (C + D - B - A) / (D - C);
-        o[ i_D ][1] += fac * 2 / (C + D - B - A) / (D - C);
+        o[ i_A ] += fac / (B - A);
+        o[ i_B ] -= fac / (B - A);
+        o[ i_C ] -= fac / (D - C);
+        o[ i_D ] += fac / (D - C);
     }
 
-    static void fill_continuous_histogram_simple(
-                                          long double (*o)[2], // output histogram array of (value,density) pairs
-                                          int n,               // requested number of bins for the histogram
-                                          float m,             // requested minimum of the histogram
-                                          float M,             // requested maximum of the histogram
-                                          float *x,            // input image data
-                                          int w,               // input image width
-                                          int h,                // input image height
-                                          int c
-                                         )
+    // accumulates the 2nd derivative of the histogram for the cells between two rows
+    // of 'w' pixels, 'c' is the distance between two samples of the channel
+    template <typename T>
+    static void accumulate_jumps_for_rows(T *o, int n, float m, float M,
+                                          const float *top, const float *bottom, int w, int c)
     {
-        // initialize bins (n equidistant points between m and M)
-        for (int i = 0; i < n; i++) {
-            o[i][0] = m + i * (M - m) / n;
-            o[i][1] = 0;
+        float s = (n - 1) / (M - m);
+        for (int i = 0; i < w - 1; i++) {
+            float q[4] = { top[i*c], top[(i+1)*c], bottom[i*c], bottom[(i+1)*c] };
+            sort_four_values(q);
+            accumulate_jumps_for_one_cell(o, n, m, M, s, q);
         }
-
-        // compute 2nd derivative of histogram
-        for (int j = 0; j < h - 1; j++)
-            for (int i = 0; i < w - 1; i++) {
-                float q[4]; // here we store the 4 values of the cell at (i,j)
-                copy_cell_values(q, x, w, h, c, i, j);
-                sort_four_values(q);
-                accumulate_jumps_for_one_cell(o, n, m, M, q);
-            }
-
-        // integrate twice
-        integrate_values(o, n);
-        integrate_values(o, n);
     }
 }
 
@@ -147,10 +117,13 @@ void Histogram::request(std::shared_ptr<Image> image, float min, float max, Mode
     this->max = max;
     this->image = image;
     this->region = region;
+    overview = nullptr;
     curh = 0;
+    generation++;
 
     values.clear();
     values.resize(image->c);
+    smoothJumps.assign(image->c, std::vector<double>(nbins));
 
     for (size_t d = 0; d < image->c; d++) {
         auto& histogram = values[d];
@@ -160,68 +133,206 @@ void Histogram::request(std::shared_ptr<Image> image, float min, float max, Mode
 }
 
 float Histogram::getProgressPercentage() const {
+    std::lock_guard<std::recursive_mutex> _lock(lock);
     std::shared_ptr<Image> image = this->image.lock();
     if (loaded) return 1.f;
     if (!image) return 0.f;
-    return (float) curh / region.GetHeight();
+    return (float) curh / (overview ? overviewRegion : region).GetHeight();
+}
+
+// bins 'n' pixels of 'c' interleaved channels into 'counts' (2*c histograms of nbins+1 bins)
+// the bin indices are computed in a separate loop so that it can be vectorized,
+// out of range and non-finite values go to the last bin which is ignored
+// neighbouring pixels often fall in the same bin, so they are counted in two
+// sub-histograms to avoid waiting on the same counter
+static void binSamples(const float* samples, size_t n, size_t c, float min, float f, int nbins,
+                       int* bins, uint32_t* counts)
+{
+    size_t ns = n * c;
+    for (size_t i = 0; i < ns; i++) {
+        float b = (samples[i] - min) * f;
+        bins[i] = (b >= 0 && b < nbins) ? (int) b : nbins;
+    }
+    uint32_t* counts2 = counts + c*(nbins+1);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        for (size_t d = 0; d < c; d++) {
+            counts[d*(nbins+1) + bins[i*c+d]]++;
+            counts2[d*(nbins+1) + bins[(i+1)*c+d]]++;
+        }
+    }
+    for (; i < n; i++) {
+        for (size_t d = 0; d < c; d++) {
+            counts[d*(nbins+1) + bins[i*c+d]]++;
+        }
+    }
+}
+
+// accumulates the jumps of the cells between the rows [fromh, toh) of the region and their next row,
+// in 'nbands' bands of rows run in parallel, each with its own accumulators of type T
+template <typename T>
+static void accumulateSmoothBands(const Image& image, int nbins, float min, float max,
+                                  size_t minx, size_t minh, size_t width, size_t height,
+                                  size_t fromh, size_t toh, size_t nbands, std::vector<double>& jumps)
+{
+    const size_t c = image.c;
+    std::vector<std::vector<T>> bandJumps(nbands, std::vector<T>(c * nbins, 0));
+    SleepyLoadingThreadPool::parallelFor(nbands, [&](size_t band) {
+        // the cells between the rows y and y+1 are processed with the row y
+        size_t y0 = fromh + (toh - fromh) * band / nbands;
+        size_t y1 = fromh + (toh - fromh) * (band + 1) / nbands;
+        std::vector<float> top(width * c);
+        std::vector<float> bottom(width * c);
+        image.readSamples(((minh+y0)*image.w + minx)*c, top.size(), top.data());
+        for (size_t y = y0; y < y1 && y + 1 < height; y++) {
+            image.readSamples(((minh+y+1)*image.w + minx)*c, bottom.size(), bottom.data());
+            for (size_t d = 0; d < c; d++) {
+                imscript::accumulate_jumps_for_rows(&bandJumps[band][d*nbins], nbins, min, max,
+                                                    top.data()+d, bottom.data()+d, width, c);
+            }
+            std::swap(top, bottom);
+        }
+    });
+    for (auto& b : bandJumps) {
+        for (size_t i = 0; i < b.size(); i++) {
+            jumps[i] += b[i];
+        }
+    }
 }
 
 void Histogram::progress()
 {
-    std::vector<std::vector<long>> valuescopy;
-    size_t oldh;
+    size_t oldgeneration;
+    size_t fromh;
+    Mode mode;
+    float min, max;
+    ImRect region;
+    std::shared_ptr<Image> overview;
     {
         std::lock_guard<std::recursive_mutex> _lock(lock);
-        valuescopy = values;
-        oldh = curh;
+        oldgeneration = generation;
+        fromh = curh;
+        mode = this->mode;
+        min = this->min;
+        max = this->max;
+        region = this->region;
+        overview = this->overview;
+        if (overview)
+            region = overviewRegion;
     }
 
     std::shared_ptr<Image> image = this->image.lock();
     if (!image) return;
 
-    if (mode == EXACT) {
+    // the statistics of a large region of a tiled image are taken from fewer samples
+    if (image->isTiled() && !overview && fromh == 0) {
+        overview = image->getOverview(region);
+        std::lock_guard<std::recursive_mutex> _lock(lock);
+        if (oldgeneration != generation)
+            return;
+        this->overview = overview;
+        overviewRegion = region;
+    }
+    if (overview)
+        image = overview;
+
+    const size_t c = image->c;
+    size_t height = region.GetHeight();
+    size_t toh = height;
+    std::vector<std::vector<long>> whole;
+    // one array of counts per thread, merged under the lock
+    std::vector<std::vector<uint32_t>> counts;
+    std::vector<double> jumps;
+
+    std::shared_ptr<HistogramIndex> index = image->histogramIndex;
+    // rows already counted cannot be mixed with the index
+    bool indexed = mode == EXACT && fromh == 0 && index && index->matches(min, max, nbins);
+
+    if (indexed) {
+        // the whole region at once
+        whole.assign(c, std::vector<long>(nbins));
+        index->accumulate(region, whole);
+    } else if (mode == EXACT) {
         size_t minh = region.Min.y;
         size_t minx = region.Min.x;
-        size_t maxx = region.Max.x;
-        for (size_t d = 0; d < image->c; d++) {
-            auto& histogram = valuescopy[d];
-            // nbins-1 because we want the last bin to end at 'max' and not start at 'max'
-            float f = (nbins-1) / (max - min);
-            for (size_t i = minx; i < maxx; i++) {
-                // TODO: sometimes it crashes here
-                int bin = (image->pixels[((minh+curh)*image->w + i)*image->c+d] - min) * f;
-                if (bin >= 0 && bin < nbins) {
-                    histogram[bin]++;
-                }
+        size_t width = region.GetWidth();
+        // about a million samples per call and per thread of the loading pool
+        size_t nthreads = SleepyLoadingThreadPool::getCurrentSize();
+        size_t rows = std::max<size_t>(1, (1<<20) * nthreads / std::max<size_t>(1, width * c));
+        toh = std::min(height, fromh + rows);
+
+        // nbins-1 because we want the last bin to end at 'max' and not start at 'max'
+        float f = (nbins-1) / (max - min);
+        // the rows are split in bands, binned by the idle threads of the pool in their own counts
+        size_t nbands = std::min(nthreads, toh - fromh);
+        counts.assign(nbands, std::vector<uint32_t>(2 * c * (nbins+1), 0));
+        SleepyLoadingThreadPool::parallelFor(nbands, [&](size_t band) {
+            std::vector<float> row(width * c);
+            std::vector<int> bins(width * c);
+            size_t y0 = fromh + (toh - fromh) * band / nbands;
+            size_t y1 = fromh + (toh - fromh) * (band + 1) / nbands;
+            for (size_t y = y0; y < y1; y++) {
+                image->readSamples(((minh+y)*image->w + minx)*c, row.size(), row.data());
+                binSamples(row.data(), width, c, min, f, nbins, bins.data(), counts[band].data());
             }
-        }
+        });
     } else if (mode == SMOOTH) {
-        long double bins[3+nbins][2];
-        for (size_t d = 0; d < image->c; d++) {
-            imscript::fill_continuous_histogram_simple(bins, nbins, min, max, image->pixels+d, image->w, image->h, image->c);
-            for (int b = 0; b < nbins; b++) {
-                valuescopy[d][b] = bins[b][1];
-            }
+        size_t minh = region.Min.y;
+        size_t minx = region.Min.x;
+        size_t width = region.GetWidth();
+        size_t nthreads = SleepyLoadingThreadPool::getCurrentSize();
+        size_t rows = std::max<size_t>(1, (1<<20) * nthreads / std::max<size_t>(1, width * c));
+        toh = std::min(height, fromh + rows);
+
+        // the rows are split in bands, each thread accumulates the jumps of its band
+        size_t nbands = std::min(nthreads, toh - fromh);
+        jumps.assign(c * nbins, 0);
+        if (gPreciseHistogram) {
+            accumulateSmoothBands<double>(*image, nbins, min, max, minx, minh, width, height, fromh, toh, nbands, jumps);
+        } else {
+            accumulateSmoothBands<float>(*image, nbins, min, max, minx, minh, width, height, fromh, toh, nbands, jumps);
         }
     }
 
     {
         std::lock_guard<std::recursive_mutex> _lock(lock);
-        if (oldh != curh) {
+        if (oldgeneration != generation) {
             // someone called request()
             return;
         }
-        if (mode == EXACT) {
-            curh++;
-        } else {
-            curh = region.GetHeight();
+
+        // the counts are merged, the current histogram stays readable by draw()
+        for (size_t d = 0; d < c; d++) {
+            auto& histogram = values[d];
+            if (mode == EXACT && !indexed) {
+                for (auto& band : counts) {
+                    const uint32_t* counts1 = &band[d*(nbins+1)];
+                    const uint32_t* counts2 = &band[(c+d)*(nbins+1)];
+                    for (int b = 0; b < nbins; b++) {
+                        histogram[b] += counts1[b] + counts2[b];
+                    }
+                }
+            } else if (!jumps.empty()) {
+                // the jumps add up, the density is integrated again for each partial result
+                std::vector<double>& total = smoothJumps[d];
+                for (int b = 0; b < nbins; b++) {
+                    total[b] += jumps[d*nbins+b];
+                }
+                std::vector<double> density(total);
+                imscript::integrate_values(density.data(), nbins);
+                imscript::integrate_values(density.data(), nbins);
+                for (int b = 0; b < nbins; b++) {
+                    histogram[b] = density[b];
+                }
+            } else {
+                histogram = whole[d];
+            }
         }
 
-        if (curh == region.GetHeight()) {
+        curh = toh;
+        if (curh == height) {
             loaded = true;
         }
-
-        values = valuescopy;
     }
 }
 
@@ -16,6 +16,8 @@ class Histogram : public Progressable {
 private:
     bool loaded;
     mutable std::recursive_mutex lock;
+    // incremented by request(), to drop the results computed for a previous request
+    size_t generation;
 public:
     enum Mode {
         SMOOTH,
@@ -23,13 +25,18 @@ public:
     } mode;
     float min, max;
     std::vector<std::vector<long>> values;
+    // 2nd derivative of the SMOOTH histograms, accumulated by bands of rows
+    std::vector<std::vector<double>> smoothJumps;
     std::weak_ptr<Image> image;
     size_t curh;
     const int nbins;
     ImRect region;
+    // read in place of a large region of a tiled image, see Image::getOverview()
+    std::shared_ptr<Image> overview;
+    ImRect overviewRegion;
 
 public:
-    Histogram() : loaded(true), image(std::weak_ptr<Image>()), curh(0), nbins(256), region() {}
+    Histogram() : loaded(true), generation(0), image(std::weak_ptr<Image>()), curh(0), nbins(256), region() {}
 
     void request(std::shared_ptr<Image> image, float min, float max, Mode mode, ImRect region=ImRect(0,0,0,0));
 
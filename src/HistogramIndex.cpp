@@ -0,0 +1,202 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "Image.hpp"
+#include "HistogramIndex.hpp"
+
+HistogramIndex::HistogramIndex(std::shared_ptr<Image> image, int nbins)
+    : image(image), w(image->w), h(image->h), c(image->c),
+      min(image->min), max(image->max), nbins(nbins), curty(0), loaded(false)
+{
+    tw = (w + TILESIZE - 1) / TILESIZE;
+    th = (h + TILESIZE - 1) / TILESIZE;
+}
+
+float HistogramIndex::getProgressPercentage() const
+{
+    if (loaded || !th) return 1.f;
+    return (float) curty / th;
+}
+
+// one row of tiles per call
+void HistogramIndex::progress()
+{
+    std::shared_ptr<Image> image = this->image.lock();
+    if (!image || curty >= th) {
+        loaded = true;
+        return;
+    }
+
+    if (integral.empty()) {
+        integral.assign((tw+1) * (th+1) * c * nbins, 0);
+        tilemin.assign(tw * th * c, std::numeric_limits<float>::max());
+        tilemax.assign(tw * th * c, std::numeric_limits<float>::lowest());
+    }
+
+    // same binning as Histogram
+    float f = (nbins-1) / (max - min);
+    size_t ty = curty;
+    std::vector<uint32_t> counts(tw * c * nbins);
+    std::vector<float> row(w * c);
+    for (size_t y = ty * TILESIZE; y < std::min(h, (ty+1) * TILESIZE); y++) {
+        image->readSamples(y * w * c, w * c, row.data());
+        for (size_t tx = 0; tx < tw; tx++) {
+            float* lo = &tilemin[(ty*tw+tx)*c];
+            float* hi = &tilemax[(ty*tw+tx)*c];
+            uint32_t* tilecounts = &counts[tx*c*nbins];
+            for (size_t x = tx * TILESIZE; x < std::min(w, (tx+1) * TILESIZE); x++) {
+                for (size_t d = 0; d < c; d++) {
+                    float v = row[x*c+d];
+                    if (!std::isfinite(v))
+                        continue;
+                    lo[d] = std::min(lo[d], v);
+                    hi[d] = std::max(hi[d], v);
+                    int bin = (v - min) * f;
+                    if (bin >= 0 && bin < nbins) {
+                        tilecounts[d*nbins+bin]++;
+                    }
+                }
+            }
+        }
+    }
+
+    // prefix sums along the row of tiles, added to the previous row
+    size_t stride = c * nbins;
+    const uint32_t* above = &integral[ty * (tw+1) * stride];
+    uint32_t* current = &integral[(ty+1) * (tw+1) * stride];
+    std::vector<uint32_t> running(stride);
+    for (size_t tx = 0; tx < tw; tx++) {
+        for (size_t i = 0; i < stride; i++) {
+            running[i] += counts[tx*stride+i];
+            current[(tx+1)*stride+i] = above[(tx+1)*stride+i] + running[i];
+        }
+    }
+
+    curty++;
+    if (curty == th) {
+        loaded = true;
+    }
+}
+
+// range of the tiles that are fully inside the region
+void HistogramIndex::getFullTiles(const ImRect& region, size_t& tx0, size_t& ty0, size_t& tx1, size_t& ty1) const
+{
+    size_t x0 = region.Min.x;
+    size_t y0 = region.Min.y;
+    size_t x1 = region.Max.x;
+    size_t y1 = region.Max.y;
+    tx0 = (x0 + TILESIZE - 1) / TILESIZE;
+    ty0 = (y0 + TILESIZE - 1) / TILESIZE;
+    tx1 = x1 >= w ? tw : x1 / TILESIZE;
+    ty1 = y1 >= h ? th : y1 / TILESIZE;
+    tx1 = std::max(tx0, tx1);
+    ty1 = std::max(ty0, ty1);
+}
+
+// calls f(samples, n) for the row segments of the region that are not covered by full tiles
+template <typename F>
+void HistogramIndex::forEachBorderRow(const std::shared_ptr<Image>& image, const ImRect& region, F f) const
+{
+    size_t x0 = region.Min.x;
+    size_t y0 = region.Min.y;
+    size_t x1 = std::min((size_t) region.Max.x, w);
+    size_t y1 = std::min((size_t) region.Max.y, h);
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    size_t tx0, ty0, tx1, ty1;
+    getFullTiles(region, tx0, ty0, tx1, ty1);
+    size_t px0 = x0, px1 = x0, py0 = y0, py1 = y0;
+    if (tx0 < tx1 && ty0 < ty1) {
+        px0 = tx0 * TILESIZE;
+        px1 = std::min(tx1 * TILESIZE, w);
+        py0 = ty0 * TILESIZE;
+        py1 = std::min(ty1 * TILESIZE, h);
+    }
+
+    std::vector<float> row((x1 - x0) * c);
+    auto segment = [&](size_t y, size_t from, size_t to) {
+        if (from >= to)
+            return;
+        image->readSamples((y * w + from) * c, (to - from) * c, row.data());
+        f(row.data(), (to - from) * c);
+    };
+    for (size_t y = y0; y < y1; y++) {
+        if (y >= py0 && y < py1) {
+            segment(y, x0, px0);
+            segment(y, px1, x1);
+        } else {
+            segment(y, x0, x1);
+        }
+    }
+}
+
+void HistogramIndex::accumulate(ImRect region, std::vector<std::vector<long>>& values) const
+{
+    std::shared_ptr<Image> image = this->image.lock();
+    if (!image || !loaded)
+        return;
+
+    size_t tx0, ty0, tx1, ty1;
+    getFullTiles(region, tx0, ty0, tx1, ty1);
+    if (tx0 < tx1 && ty0 < ty1) {
+        size_t stride = c * nbins;
+        auto at = [&](size_t ty, size_t tx) {
+            return &integral[(ty * (tw+1) + tx) * stride];
+        };
+        const uint32_t* a = at(ty0, tx0);
+        const uint32_t* b = at(ty0, tx1);
+        const uint32_t* cc = at(ty1, tx0);
+        const uint32_t* dd = at(ty1, tx1);
+        for (size_t d = 0; d < c; d++) {
+            for (int bin = 0; bin < nbins; bin++) {
+                size_t i = d * nbins + bin;
+                values[d][bin] += (long) dd[i] - b[i] - cc[i] + a[i];
+            }
+        }
+    }
+
+    float f = (nbins-1) / (max - min);
+    forEachBorderRow(image, region, [&](const float* samples, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            float v = samples[i];
+            if (!std::isfinite(v))
+                continue;
+            int bin = (v - min) * f;
+            if (bin >= 0 && bin < nbins) {
+                values[i % c][bin]++;
+            }
+        }
+    });
+}
+
+void HistogramIndex::getBounds(ImRect region, float& low, float& high) const
+{
+    low = std::numeric_limits<float>::max();
+    high = std::numeric_limits<float>::lowest();
+    std::shared_ptr<Image> image = this->image.lock();
+    if (!image || !loaded)
+        return;
+
+    size_t tx0, ty0, tx1, ty1;
+    getFullTiles(region, tx0, ty0, tx1, ty1);
+    for (size_t ty = ty0; ty < ty1; ty++) {
+        for (size_t tx = tx0; tx < tx1; tx++) {
+            for (size_t d = 0; d < c; d++) {
+                low = std::min(low, tilemin[(ty*tw+tx)*c+d]);
+                high = std::max(high, tilemax[(ty*tw+tx)*c+d]);
+            }
+        }
+    }
+
+    forEachBorderRow(image, region, [&](const float* samples, size_t n) {
+        for (size_t i = 0; i < n; i++) {
+            float v = samples[i];
+            if (std::isfinite(v)) {
+                low = std::min(low, v);
+                high = std::max(high, v);
+            }
+        }
+    });
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+#include "imgui.h"
+#define IMGUI_DEFINE_MATH_OPERATORS
+#include "imgui_internal.h"
+
+#include "Progressable.hpp"
+
+struct Image;
+
+// histograms and bounds of the tiles of an image, built in the background
+// the tile histograms are stored as prefix sums so that the histogram of a region
+// is assembled from its full tiles, only the pixels on its border are visited
+class HistogramIndex : public Progressable {
+    std::weak_ptr<Image> image;
+    size_t w, h, c;
+    size_t tw, th;
+    float min, max;
+    const int nbins;
+
+    // counts of the tiles [0,tx)x[0,ty), indexed by ((ty*(tw+1)+tx)*c+d)*nbins+bin
+    std::vector<uint32_t> integral;
+    // bounds of the finite values of each tile, indexed by (ty*tw+tx)*c+d
+    std::vector<float> tilemin;
+    std::vector<float> tilemax;
+
+    size_t curty;
+    std::atomic<bool> loaded;
+
+    void getFullTiles(const ImRect& region, size_t& tx0, size_t& ty0, size_t& tx1, size_t& ty1) const;
+    template <typename F>
+    void forEachBorderRow(const std::shared_ptr<Image>& image, const ImRect& region, F f) const;
+
+public:
+    static const size_t TILESIZE = 128;
+
+    HistogramIndex(std::shared_ptr<Image> image, int nbins=256);
+
+    float getProgressPercentage() const;
+
+    bool isLoaded() const {
+        return loaded;
+    }
+
+    void progress();
+
+    // true if the index can answer for histograms with these parameters
+    bool matches(float min, float max, int nbins) const {
+        return loaded && min == this->min && max == this->max && nbins == this->nbins;
+    }
+
+    // adds the histogram of each channel in 'region' to 'values'
+    void accumulate(ImRect region, std::vector<std::vector<long>>& values) const;
+
+    // bounds of the finite values of all the channels in 'region'
+    void getBounds(ImRect region, float& low, float& high) const;
+};
+
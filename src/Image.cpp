@@ -1,7 +1,9 @@
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <limits>
 #include <algorithm>
+#include <atomic>
 
 extern "C" {
 #include "iio.h"
@@ -9,37 +11,271 @@ extern "C" {
 
 #include "Image.hpp"
 #include "Histogram.hpp"
+#include "convert.hpp"
 
-Image::Image(float* pixels, size_t w, size_t h, size_t c)
-    : pixels(pixels), w(w), h(h), c(c), lastUsed(0), histogram(std::make_shared<Histogram>())
+template <typename T>
+static void computeMinMax(const T* samples, size_t n, float& min, float& max)
+{
+    T lo = samples[0];
+    T hi = samples[0];
+    for (size_t i = 1; i < n; i++) {
+        lo = std::min(lo, samples[i]);
+        hi = std::max(hi, samples[i]);
+    }
+    min = lo;
+    max = hi;
+}
+
+static void computeMinMax(const float* samples, size_t n, float& min, float& max)
 {
     min = std::numeric_limits<float>::max();
     max = std::numeric_limits<float>::lowest();
-    for (size_t i = 0; i < w*h*c; i++) {
-        float v = pixels[i];
+    for (size_t i = 0; i < n; i++) {
+        float v = samples[i];
         min = std::min(min, v);
         max = std::max(max, v);
     }
     if (!std::isfinite(min) || !std::isfinite(max)) {
         min = std::numeric_limits<float>::max();
         max = std::numeric_limits<float>::lowest();
-        for (size_t i = 0; i < w*h*c; i++) {
-            float v = pixels[i];
+        for (size_t i = 0; i < n; i++) {
+            float v = samples[i];
             if (std::isfinite(v)) {
                 min = std::min(min, v);
                 max = std::max(max, v);
             }
         }
     }
+}
+
+Image::Image(float* pixels, size_t w, size_t h, size_t c)
+    : Image(pixels, F32, w, h, c)
+{
+}
+
+Image::Image(void* pixels, Type type, size_t w, size_t h, size_t c, std::shared_ptr<void> owner)
+    : pixels(pixels), type(type), w(w), h(h), c(c), lastUsed(0), histogram(std::make_shared<Histogram>()),
+      owner(owner), validRows(h)
+{
+    computeRange();
     size = ImVec2(w, h);
 }
 
+std::shared_ptr<Image> Image::makePartial(void* pixels, Type type, size_t w, size_t h, size_t c)
+{
+    // constructed empty so that the samples are not visited
+    std::shared_ptr<Image> image = std::make_shared<Image>(pixels, type, 0, 0, c);
+    image->w = w;
+    image->h = h;
+    image->size = ImVec2(w, h);
+    image->min = 0.f;
+    image->max = type == U8 ? 255.f : type == U16 ? 65535.f : 1.f;
+    image->validRows = 0;
+    return image;
+}
+
+void Image::finishPartial()
+{
+    computeRange();
+    validRows.store(h, std::memory_order_release);
+}
+
+void Image::computeRange()
+{
+    size_t n = w*h*c;
+    if (n == 0) {
+        min = std::numeric_limits<float>::max();
+        max = std::numeric_limits<float>::lowest();
+    } else if (type == U8) {
+        computeMinMax((const uint8_t*) pixels, n, min, max);
+    } else if (type == U16) {
+        computeMinMax((const uint16_t*) pixels, n, min, max);
+    } else if (type == F16) {
+        std::shared_ptr<const float> values = getFloatPixels();
+        computeMinMax(values.get(), n, min, max);
+    } else {
+        computeMinMax((const float*) pixels, n, min, max);
+    }
+}
+
+Image::Image(std::shared_ptr<ImageSource> source, Type type, size_t w, size_t h, size_t c)
+    : pixels(nullptr), type(type), w(w), h(h), c(c), lastUsed(0), histogram(std::make_shared<Histogram>()),
+      source(source), validRows(h)
+{
+    // the keys of the blocks stay unique even if the address of the image is reused
+    static std::atomic<size_t> counter(0);
+    blockPrefix = "block:" + std::to_string(counter++) + ":";
+
+    size = ImVec2(w, h);
+    if (w * h * c == 0) {
+        min = std::numeric_limits<float>::max();
+        max = std::numeric_limits<float>::lowest();
+    } else {
+        std::shared_ptr<Image> block = getBlock(w / 2 / source->bw, h / 2 / source->bh);
+        min = block->min;
+        max = block->max;
+    }
+}
+
+// calls f(block, offset, n) for the runs of samples of a tiled image that lie in a single block
+template <typename F>
+static void forEachBlockRun(const Image& image, size_t offset, size_t n, F f)
+{
+    size_t bw = image.source->bw;
+    size_t bh = image.source->bh;
+    size_t c = image.c;
+    while (n > 0) {
+        size_t x = offset / c % image.w;
+        size_t y = offset / c / image.w;
+        size_t d = offset % c;
+        std::shared_ptr<Image> block = image.getBlock(x / bw, y / bh);
+        size_t bx = x % bw;
+        size_t by = y % bh;
+        size_t count = std::min(n, (block->w - bx) * c - d);
+        f(*block, (by * block->w + bx) * c + d, count);
+        offset += count;
+        n -= count;
+    }
+}
+
+size_t Image::getSampleSize() const
+{
+    switch (type) {
+        case U8: return 1;
+        case U16: return 2;
+        case F16: return 2;
+        case F32: return 4;
+    }
+    return 4;
+}
+
+void Image::readSamples(size_t offset, size_t n, float* values) const
+{
+    if (source) {
+        forEachBlockRun(*this, offset, n, [&](const Image& block, size_t o, size_t count) {
+            block.readSamples(o, count, values);
+            values += count;
+        });
+        return;
+    }
+
+    switch (type) {
+        case U8:
+            convert::toFloat(convert::U8, (const uint8_t*) pixels + offset, n, values);
+            break;
+        case U16:
+            convert::toFloat(convert::U16, (const uint16_t*) pixels + offset, n, values);
+            break;
+        case F16:
+            convert::toFloat(convert::F16, (const uint16_t*) pixels + offset, n, values);
+            break;
+        case F32:
+            memcpy(values, (const float*) pixels + offset, n * sizeof(float));
+            break;
+    }
+}
+
+void Image::copySamples(size_t offset, size_t n, void* dest) const
+{
+    size_t samplesize = getSampleSize();
+    if (source) {
+        uint8_t* d = (uint8_t*) dest;
+        forEachBlockRun(*this, offset, n, [&](const Image& block, size_t o, size_t count) {
+            memcpy(d, (const uint8_t*) block.pixels + o * samplesize, count * samplesize);
+            d += count * samplesize;
+        });
+        return;
+    }
+    memcpy(dest, (const uint8_t*) pixels + offset * samplesize, n * samplesize);
+}
+
+std::shared_ptr<const float> Image::getFloatPixels() const
+{
+    if (type == F32) {
+        // no-op deleter, the image owns the samples
+        return std::shared_ptr<const float>((const float*) pixels, [](const float*) {});
+    }
+    size_t n = w*h*c;
+    float* values = (float*) malloc(sizeof(float) * n);
+    readSamples(0, n, values);
+    return std::shared_ptr<const float>(values, [](const float* v) { free((void*) v); });
+}
+
 #include "ImageCache.hpp"
 #include "ImageProvider.hpp"
+#include "ImagePyramid.hpp"
+std::shared_ptr<Image> Image::getBlock(size_t bx, size_t by) const
+{
+    std::string key = blockPrefix + std::to_string(bx) + ":" + std::to_string(by);
+    std::shared_ptr<Image> block = ImageCache::get(key);
+    if (block)
+        return block;
+
+    std::lock_guard<std::mutex> _lock(source->lock);
+    // another thread might have read it meanwhile
+    block = ImageCache::get(key);
+    if (block)
+        return block;
+
+    size_t bw = std::min(source->bw, w - bx * source->bw);
+    size_t bh = std::min(source->bh, h - by * source->bh);
+    void* blockpixels = calloc(bw * bh * c, getSampleSize());
+    if (!source->readBlock(bx, by, blockpixels)) {
+        LOG("cannot read block " << bx << "," << by);
+    }
+    block = std::make_shared<Image>(blockpixels, type, bw, bh, c);
+    ImageCache::store(key, block);
+    return block;
+}
+
+// samples read for the statistics of a region of a tiled image
+static const size_t OVERVIEW_PIXELS = 1 << 22;
+
+std::shared_ptr<Image> Image::getOverview(ImRect& region) const
+{
+    if (!source || region.GetWidth() * region.GetHeight() <= OVERVIEW_PIXELS)
+        return nullptr;
+
+    std::shared_ptr<Image> level = pyramid ? pyramid->getSmallestLevel() : nullptr;
+    if (level && !level->isTiled()) {
+        float sx = level->w / (float) w;
+        float sy = level->h / (float) h;
+        region = ImRect(std::floor(region.Min.x * sx), std::floor(region.Min.y * sy),
+                        std::ceil(region.Max.x * sx), std::ceil(region.Max.y * sy));
+        region.ClipWithFull(ImRect(0, 0, level->w, level->h));
+        return level;
+    }
+
+    // the blocks are spread evenly over the region
+    size_t bw = source->bw;
+    size_t bh = source->bh;
+    size_t bx0 = region.Min.x / bw, bx1 = (region.Max.x - 1) / bw + 1;
+    size_t by0 = region.Min.y / bh, by1 = (region.Max.y - 1) / bh + 1;
+    size_t side = std::max<size_t>(1, std::sqrt(OVERVIEW_PIXELS / (bw * bh)));
+    size_t nx = std::min(side, bx1 - bx0);
+    size_t ny = std::min(side, by1 - by0);
+    size_t mw = nx * bw;
+    size_t mh = ny * bh;
+    float* mosaic = (float*) malloc(sizeof(float) * mw * mh * c);
+    std::fill(mosaic, mosaic + mw * mh * c, std::numeric_limits<float>::quiet_NaN());
+    for (size_t j = 0; j < ny; j++) {
+        for (size_t i = 0; i < nx; i++) {
+            std::shared_ptr<Image> block = getBlock(bx0 + i * (bx1 - bx0) / nx, by0 + j * (by1 - by0) / ny);
+            for (size_t y = 0; y < block->h; y++) {
+                block->readSamples(y * block->w * c, block->w * c, mosaic + ((j * bh + y) * mw + i * bw) * c);
+            }
+        }
+    }
+    region = ImRect(0, 0, mw, mh);
+    return std::make_shared<Image>(mosaic, mw, mh, c);
+}
+
 Image::~Image()
 {
     LOG("free image");
-    free(pixels);
+    if (!owner) {
+        free(pixels);
+    }
 }
 
 void Image::getPixelValueAt(size_t x, size_t y, float* values, size_t d) const
@@ -47,27 +283,25 @@ void Image::getPixelValueAt(size_t x, size_t y, float* values, size_t d) const
     if (x >= w || y >= h)
         return;
 
-    const float* data = (float*) pixels + (w * y + x)*c;
-    const float* end = (float*) pixels + (w * h)*c;
-    for (size_t i = 0; i < d; i++) {
-        if (data + i >= end) break;
-        values[i] = data[i];
-    }
+    size_t offset = (w * y + x)*c;
+    readSamples(offset, std::min(d, w*h*c - offset), values);
 }
 
 bool Image::cutChannels()
 {
-    if (c > 4) {
-        float* copy = (float*) malloc(sizeof(float) * w * h * 4);
-        for (size_t y = 0; y < (size_t)h; y++) {
-            for (size_t x = 0; x < (size_t)w; x++) {
-                for (size_t l = 0; l < 4; l++) {
-                    copy[(y*w+x)*4+l] = pixels[(y*w+x)*c+l];
-                }
-            }
+    // the sources of tiled images provide at most 4 channels
+    if (c > 4 && !source) {
+        size_t size = getSampleSize();
+        uint8_t* copy = (uint8_t*) malloc(size * w * h * 4);
+        const uint8_t* src = (const uint8_t*) pixels;
+        for (size_t i = 0; i < w*h; i++) {
+            memcpy(copy + i*4*size, src + i*c*size, 4*size);
         }
         c = 4;
-        free(pixels);
+        if (!owner) {
+            free(pixels);
+        }
+        owner = nullptr;
         pixels = copy;
         return true;
     }
@@ -2,6 +2,10 @@
 
 #include <set>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <cstdint>
 
 #include "imgui.h"
 
@@ -15,24 +19,102 @@ struct ImageTile {
 };
 #endif
 
+struct ImRect;
 class Histogram;
+class HistogramIndex;
+class ImagePyramid;
+
+// pixels of an image too large to be decoded at once, read by blocks on demand
+class ImageSource {
+public:
+    // serializes the reads, the decoders are not thread safe
+    std::mutex lock;
+    // size of the blocks, the blocks on the right and bottom borders are cropped to the image
+    size_t bw, bh;
+
+    virtual ~ImageSource() {
+    }
+
+    // decodes the block (bx, by) in 'dest', with the sample type of the image
+    // called with 'lock' held
+    virtual bool readBlock(size_t bx, size_t by, void* dest) = 0;
+};
 
 struct Image {
-    float* pixels;
+    // type of the samples stored in 'pixels'
+    enum Type {
+        U8,
+        U16,
+        F16,
+        F32,
+    };
+
+    void* pixels;
+    Type type;
     size_t w, h, c;
     ImVec2 size;
     float min;
     float max;
     uint64_t lastUsed;
     std::shared_ptr<Histogram> histogram;
+    // set by the main thread when the image is first displayed
+    std::shared_ptr<HistogramIndex> histogramIndex;
+    // reduced resolutions for large images, also set by the main thread
+    std::shared_ptr<ImagePyramid> pyramid;
 
     std::set<std::string> usedBy;
 
+    // if set, 'pixels' points to memory owned by this object (eg. a file mapping)
+    // and is not freed with the image
+    std::shared_ptr<void> owner;
+
+    // if set, 'pixels' is null and the samples are read by blocks from the source,
+    // the blocks are kept in the ImageCache
+    std::shared_ptr<ImageSource> source;
+    std::string blockPrefix;
+
+    // rows filled by the provider of a partially decoded image, h once complete
+    // the rows above are displayed while the provider fills the others,
+    // stored with release by the provider once the rows are written, loaded with acquire by the readers
+    std::atomic<size_t> validRows;
+
     Image(float* pixels, size_t w, size_t h, size_t c);
+    Image(void* pixels, Type type, size_t w, size_t h, size_t c, std::shared_ptr<void> owner=nullptr);
+    // the range is estimated from the block at the center of the image
+    Image(std::shared_ptr<ImageSource> source, Type type, size_t w, size_t h, size_t c);
     ~Image();
 
+    // image of the samples that a provider is decoding in 'pixels', no rows are valid yet
+    // the range of the type stands for the range of the samples until finishPartial()
+    static std::shared_ptr<Image> makePartial(void* pixels, Type type, size_t w, size_t h, size_t c);
+    // called by the provider once all the rows are decoded
+    void finishPartial();
+    bool isPartial() const {
+        return validRows < h;
+    }
+
+    bool isTiled() const {
+        return source != nullptr;
+    }
+    // the block (bx, by) of a tiled image, read from the source if it is not cached
+    std::shared_ptr<Image> getBlock(size_t bx, size_t by) const;
+    // samples that stand for a large region of a tiled image in the statistics (histograms, quantiles):
+    // the smallest level of the pyramid, or else a mosaic of blocks of the region taken on a grid,
+    // the missing samples of the mosaic are NaN
+    // 'region' is changed to the region of the overview, null if the region is small enough to be read
+    std::shared_ptr<Image> getOverview(ImRect& region) const;
+
+    size_t getSampleSize() const;
+    // converts 'n' samples starting at the sample 'offset' to float
+    void readSamples(size_t offset, size_t n, float* values) const;
+    // copies 'n' samples starting at the sample 'offset' without conversion
+    void copySamples(size_t offset, size_t n, void* dest) const;
+    // all the samples as floats, not copied for F32 images
+    std::shared_ptr<const float> getFloatPixels() const;
+
     void getPixelValueAt(size_t x, size_t y, float* values, size_t d) const;
     bool cutChannels();
 
+private:
+    void computeRange();
 };
-
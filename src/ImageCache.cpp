@@ -1,7 +1,10 @@
 #include <string>
 #include <memory>
 #include <unordered_map>
+#include <list>
 #include <mutex>
+#include <atomic>
+#include <algorithm>
 #include <cstdlib>
 
 #include "Image.hpp"
@@ -10,12 +13,46 @@
 #include "events.hpp"
 
 #include "ImageProvider.hpp"
+#include "EvictionPolicy.hpp"
 
 namespace ImageCache {
-    static std::unordered_map<std::string, std::shared_ptr<Image>> cache;
+    struct Entry {
+        std::shared_ptr<Image> image;
+        std::list<std::string>::iterator lru;
+    };
+
+    static std::unordered_map<std::string, Entry> cache;
+    // keys ordered from the most recently used to the least recently used
+    static std::list<std::string> lru;
     static std::mutex lock;
     static size_t cacheSize = 0;
+    static std::atomic<long> chargedSize(0);
     static bool cacheFull = false;
+    static std::shared_ptr<EvictionPolicy> policy = std::make_shared<LRUEvictionPolicy>();
+
+    static size_t sizeOf(const std::shared_ptr<Image>& image)
+    {
+        // mapped images are accounted by the page cache, tiled images by their blocks
+        if (image->owner || image->source) {
+            return 0;
+        }
+        return image->w * image->h * image->c * image->getSampleSize();
+    }
+
+    void setEvictionPolicy(std::shared_ptr<EvictionPolicy> p)
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        policy = p;
+        for (auto& key : lru) {
+            policy->onStore(key);
+        }
+    }
+
+    void updateEvictionPolicy()
+    {
+        std::lock_guard<std::mutex> _lock(lock);
+        policy->onFrame(lru);
+    }
 
     bool has(const std::string& key)
     {
@@ -26,39 +63,44 @@ namespace ImageCache {
     std::shared_ptr<Image> get(const std::string& key)
     {
         std::lock_guard<std::mutex> _lock(lock);
-        std::shared_ptr<Image> image = cache[key];
-        return image;
+        auto i = cache.find(key);
+        if (i == cache.end()) {
+            return nullptr;
+        }
+        Entry& entry = i->second;
+        lru.splice(lru.begin(), lru, entry.lru);
+        letTimeFlow(&entry.image->lastUsed);
+        return entry.image;
+    }
+
+    static size_t getUsedSize()
+    {
+        return cacheSize + std::max<long>(0, chargedSize);
+    }
+
+    void charge(long bytes)
+    {
+        chargedSize += bytes;
     }
 
     static bool hasSpaceFor(const std::shared_ptr<Image>& image)
     {
-        size_t need = image->w * image->h * image->c * sizeof(float);
+        size_t need = sizeOf(image);
         size_t limit = gCacheLimitMB*1000000;
-        return cacheSize + need < limit;
+        return getUsedSize() + need < limit;
     }
 
-    static bool makeRoomFor(const std::shared_ptr<Image>& image)
+    static bool makeRoomFor(const std::string& key, const std::shared_ptr<Image>& image)
     {
-        size_t need = image->w * image->h * image->c * sizeof(float);
+        size_t need = sizeOf(image);
         size_t limit = gCacheLimitMB*1000000;
 
         if (need > limit) return false;
-        while (cacheSize + need > limit) {
-            std::string worst;
-
-            // FIXME: slow, use a priority queue to sort old images upto a given space limit
-            double last = -1;
-            for (auto it = cache.begin(); it != cache.end(); it++) {
-                std::shared_ptr<Image> img = it->second;
-                uint64_t t = img->lastUsed;
-                double imgtime = letTimeFlow(&t);
-                if (imgtime > last) {
-                    worst = it->first;
-                    last = imgtime;
-                }
+        while (getUsedSize() + need > limit && !lru.empty()) {
+            std::string victim = policy->selectVictim(key, lru);
+            if (victim.empty() || !remove_rec(victim)) {
+                return false;
             }
-
-            remove_rec(worst);
         }
         return true;
     }
@@ -79,14 +121,16 @@ namespace ImageCache {
         }
         if (!hasSpaceFor(image)) {
             cacheFull = true;
-            if (!makeRoomFor(image)) {
+            if (!makeRoomFor(key, image)) {
                 return;
             }
         } else {
             cacheFull = false;
         }
-        cache[key] = image;
-        cacheSize += image->w * image->h * image->c * sizeof(float);
+        lru.push_front(key);
+        cache[key] = Entry{image, lru.begin()};
+        cacheSize += sizeOf(image);
+        policy->onStore(key);
         LOG2("store image " << key << " " << image);
     }
 
@@ -94,10 +138,12 @@ namespace ImageCache {
     {
         auto i = cache.find(key);
         if (i != cache.end()) {
-            std::shared_ptr<Image> image = i->second;
+            std::shared_ptr<Image> image = i->second.image;
             LOG2("remove image " << key << " " << image);
+            lru.erase(i->second.lru);
             cache.erase(i);
-            cacheSize -= image->w * image->h * image->c * sizeof(float);
+            cacheSize -= sizeOf(image);
+            policy->onRemove(key);
             for (auto k : image->usedBy) {
                 LOG2("try remove " << k);
                 remove_rec(k);
@@ -123,6 +169,8 @@ namespace ImageCache {
     {
         std::lock_guard<std::mutex> _lock(lock);
         cache.clear();
+        lru.clear();
+        policy->onFlush();
         cacheSize = 0;
         cacheFull = false;
     }
@@ -2,11 +2,44 @@
 
 #include <string>
 #include <memory>
+#include <list>
 
 struct Image;
 
 namespace ImageCache {
 
+    // decides which image leaves the cache when there is no more room
+    // all methods are called with the cache locked
+    class EvictionPolicy {
+    public:
+        virtual ~EvictionPolicy() {
+        }
+
+        virtual void onStore(const std::string& key) {
+        }
+
+        virtual void onRemove(const std::string& key) {
+        }
+
+        virtual void onFlush() {
+        }
+
+        // called by the main thread once per frame, see updateEvictionPolicy()
+        // the state of the players is copied here, the other methods run on the loading threads
+        virtual void onFrame(const std::list<std::string>& lru) {
+        }
+
+        // 'lru' lists the cached keys from the most to the least recently used
+        // returns the key to evict, or an empty string if 'incoming' should not be cached
+        virtual std::string selectVictim(const std::string& incoming,
+                                         const std::list<std::string>& lru) = 0;
+    };
+
+    void setEvictionPolicy(std::shared_ptr<EvictionPolicy> policy);
+
+    // lets the policy take a snapshot of the players, called by the main thread
+    void updateEvictionPolicy();
+
     bool has(const std::string& key);
 
     std::shared_ptr<Image> get(const std::string& key);
@@ -18,6 +51,10 @@ namespace ImageCache {
 
     bool isFull();
 
+    // memory held by images besides their samples, such as the levels of their pyramids
+    // counted with the cached images, but does not take the lock so that destructors can call it
+    void charge(long bytes);
+
     void flush();
 
     namespace Error {
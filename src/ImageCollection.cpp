@@ -1,9 +1,13 @@
+#include <atomic>
+#include <algorithm>
 #include <sys/stat.h>
 #include "ImageProvider.hpp"
 #include "Sequence.hpp"
 #include "globals.hpp"
 #include "watcher.hpp"
 #include "ImageCollection.hpp"
+#include "MappedFile.hpp"
+#include "convert.hpp"
 
 #ifdef USE_GDAL
 #include <gdal.h>
@@ -75,7 +79,7 @@ std::shared_ptr<ImageProvider> SingleImageImageCollection::getImageProvider(int
         });
         return provider;
     };
-    return std::make_shared<CacheImageProvider>(key, provider);
+    return CacheImageProvider::create(key, provider);
 }
 
 std::shared_ptr<ImageProvider> EditedImageCollection::getImageProvider(int index) const
@@ -88,77 +92,213 @@ std::shared_ptr<ImageProvider> EditedImageCollection::getImageProvider(int index
         }
         return std::make_shared<EditedImageProvider>(edittype, editprog, providers, key);
     };
-    return std::make_shared<CacheImageProvider>(key, provider);
+    return CacheImageProvider::create(key, provider);
 }
 
 class VPPVideoImageProvider : public VideoImageProvider {
     FILE* file;
     int w, h, d;
-    int curh;
     float* pixels;
+    std::shared_ptr<MappedFile> mapping;
+    size_t offset;
+    // bands of about 1MB of rows, the ones in the region of interest are read first
+    int bandh;
+    std::vector<bool> done;
+    int ndone;
+    // owns 'pixels' once created, displayed while it is read
+    std::shared_ptr<Image> image;
 public:
-    VPPVideoImageProvider(const std::string& filename, int index, int w, int h, int d)
+    VPPVideoImageProvider(const std::string& filename, int index, int w, int h, int d,
+                          std::shared_ptr<MappedFile> mapping)
         : VideoImageProvider(filename, index),
-          file(fopen(filename.c_str(), "r")), w(w), h(h), d(d), curh(0) {
-        fseek(file, 4+3*sizeof(int)+w*h*d*sizeof(float)*index, SEEK_SET);
-        pixels = (float*) malloc(w*h*d*sizeof(float));
+          file(nullptr), w(w), h(h), d(d), pixels(nullptr), mapping(mapping), ndone(0) {
+        size_t rowsize = (size_t) w*d*sizeof(float);
+        size_t framesize = rowsize*h;
+        offset = 4+3*sizeof(int)+framesize*index;
+        bandh = std::max<size_t>(1, (1<<20) / rowsize);
+        done.assign((h + bandh - 1) / bandh, false);
+        if (mapping) {
+            // start reading this frame and the next one while waiting for a thread
+            mapping->willNeed(offset, 2*framesize);
+        } else {
+            file = fopen(filename.c_str(), "r");
+            pixels = (float*) malloc(framesize);
+        }
     }
 
     ~VPPVideoImageProvider() {
-        if (pixels)
+        if (pixels && !image)
             free(pixels);
-        fclose(file);
+        if (file)
+            fclose(file);
     }
 
     float getProgressPercentage() const {
-        return (float) curh / h;
+        return done.empty() ? 1.f : (float) ndone / done.size();
     }
 
     void progress() {
-        if (curh < h) {
-            if (!fread(pixels+curh*w*d, sizeof(float), w*d, file)) {
+        if (mapping) {
+            progressMapped();
+            return;
+        }
+        int band = nextBand();
+        if (band >= 0) {
+            size_t rowsize = (size_t) w*d*sizeof(float);
+            int y = band * bandh;
+            int n = std::min(bandh, h - y);
+            if (!file || fseek(file, offset + y*rowsize, SEEK_SET)
+                || fread(pixels+(size_t)y*w*d, rowsize, n, file) != (size_t) n) {
                 onFinish(makeError("error vpp"));
+                return;
+            }
+            done[band] = true;
+            ndone++;
+            if (d <= 4) {
+                if (!image) {
+                    image = Image::makePartial(pixels, Image::F32, w, h, d);
+                    onPartial(image);
+                }
+                image->validRows.store(getValidRows(), std::memory_order_release);
             }
-            curh++;
         } else {
-            auto image = std::make_shared<Image>(pixels, w, h, d);
+            if (image) {
+                image->finishPartial();
+            } else {
+                image = std::make_shared<Image>(pixels, w, h, d);
+            }
             onFinish(image);
             pixels = nullptr;
+            image = nullptr;
+        }
+    }
+
+private:
+    // rows above the first band that is not read
+    size_t getValidRows() const {
+        for (size_t b = 0; b < done.size(); b++) {
+            if (!done[b])
+                return b * bandh;
+        }
+        return h;
+    }
+
+    int nextBand() const {
+        size_t x0, y0, x1, y1;
+        getRegionOfInterest().getBounds(w, h, x0, y0, x1, y1);
+        for (size_t b = y0 / bandh; y0 < y1 && b <= (y1 - 1) / bandh; b++) {
+            if (!done[b])
+                return b;
+        }
+        for (size_t b = 0; b < done.size(); b++) {
+            if (!done[b])
+                return b;
+        }
+        return -1;
+    }
+
+    void progressMapped() {
+        size_t rowsize = (size_t) w*d*sizeof(float);
+        // a truncated file is an error, as with fread
+        if (offset + rowsize*h > mapping->getSize() || !mapping->isIntact()) {
+            onFinish(makeError("error vpp"));
+            return;
+        }
+        const uint8_t* frame = mapping->getData() + offset;
+        int band = nextBand();
+        if (band >= 0) {
+            // fault the pages in from this thread, so that the main thread does not wait on the disk later
+            int y = band * bandh;
+            int end = std::min(h, y + bandh);
+            const volatile uint8_t* p = frame + y*rowsize;
+            const volatile uint8_t* last = frame + end*rowsize;
+            for (; p < last; p += 4096) {
+                (void) *p;
+            }
+            done[band] = true;
+            ndone++;
+        } else {
+            auto image = std::make_shared<Image>((void*) frame, Image::F32, w, h, d, mapping);
+            onFinish(image);
         }
     }
 };
 
-class VPPVideoImageCollection : public VideoImageCollection {
+// the frames of a mapped file are views into the mapping, so when the file changes all of them
+// leave the cache, not only the one being displayed
+static void invalidateFrames(const ImageCollection& collection, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        std::string key = collection.getKey(i);
+        ImageCache::Error::remove(key);
+        ImageCache::remove(key);
+    }
+    gReloadImages = true;
+}
+
+// header of a VPP file and its mapping, replaced as a whole when the file is reloaded
+struct VPPHeader {
     size_t length;
-    int error;
     int w, h, d;
-public:
-    VPPVideoImageCollection(const std::string& filename) : VideoImageCollection(filename), length(0) {
+    std::shared_ptr<MappedFile> mapping;
+};
+
+class VPPVideoImageCollection : public VideoImageCollection {
+    // written by the main thread, read by the loading threads
+    std::shared_ptr<const VPPHeader> header;
+    // expires with the collection, the callbacks of the watcher cannot be removed
+    std::shared_ptr<bool> alive;
+
+    std::shared_ptr<const VPPHeader> loadHeader() const {
+        auto header = std::make_shared<VPPHeader>();
+        header->length = 0;
         FILE* file = fopen(filename.c_str(), "r");
         char tag[4];
-        if (fread(tag, 1, 4, file) == 4
-            && fread(&w, sizeof(int), 1, file)
-            && fread(&h, sizeof(int), 1, file)
-            && fread(&d, sizeof(int), 1, file)) {
+        if (file && fread(tag, 1, 4, file) == 4
+            && fread(&header->w, sizeof(int), 1, file)
+            && fread(&header->h, sizeof(int), 1, file)
+            && fread(&header->d, sizeof(int), 1, file)) {
             fseek(file, 0, SEEK_END);
-            length = (ftell(file)-4-3*sizeof(int)) / (w*h*d*sizeof(float));
+            header->length = (ftell(file)-4-3*sizeof(int)) / (header->w*header->h*header->d*sizeof(float));
+        }
+        if (file)
+            fclose(file);
+
+        header->mapping = std::make_shared<MappedFile>(filename);
+        if (!header->mapping->isValid()) {
+            header->mapping = nullptr;
         }
-        fclose(file);
+        return header;
+    }
+
+public:
+    VPPVideoImageCollection(const std::string& filename)
+        : VideoImageCollection(filename), alive(std::make_shared<bool>(true)) {
+        header = loadHeader();
+        std::weak_ptr<bool> watched = alive;
+        watcher_add_file(filename, [this,watched](const std::string& fname) {
+            if (watched.expired())
+                return;
+            LOG("file changed " << filename);
+            invalidateFrames(*this, header->length);
+            std::atomic_store(&header, loadHeader());
+        });
     }
 
     ~VPPVideoImageCollection() {
     }
 
     int getLength() const {
-        return length;
+        return header->length;
     }
 
     std::shared_ptr<ImageProvider> getImageProvider(int index) const {
         auto provider = [&]() {
-            return std::make_shared<VPPVideoImageProvider>(filename, index, w, h, d);
+            std::shared_ptr<const VPPHeader> h = std::atomic_load(&header);
+            return std::make_shared<VPPVideoImageProvider>(filename, index, h->w, h->h, h->d, h->mapping);
         };
         std::string key = getKey(index);
-        return std::make_shared<CacheImageProvider>(key, provider);
+        return CacheImageProvider::create(key, provider);
     }
 };
 
@@ -166,14 +306,37 @@ extern "C" {
 #include "npy.h"
 }
 
+// converts with the kernels of convert.hpp, the 64-bit integers and the long doubles are left to npy.c
+static void convertNpySamples(float* dest, const void* src, size_t n, int type)
+{
+    int size, isfloat, issigned;
+    npy_type_describe(type, &size, &isfloat, &issigned);
+    convert::Format format;
+    if (isfloat && size == 2) format = convert::F16;
+    else if (isfloat && size == 4) format = convert::F32;
+    else if (isfloat && size == 8) format = convert::F64;
+    else if (!isfloat && size == 1) format = issigned ? convert::I8 : convert::U8;
+    else if (!isfloat && size == 2) format = issigned ? convert::I16 : convert::U16;
+    else if (!isfloat && size == 4) format = issigned ? convert::I32 : convert::U32;
+    else {
+        npy_convert_into_float(dest, src, n, type);
+        return;
+    }
+    convert::toFloat(format, src, n, dest);
+}
+
 class NumpyVideoImageProvider : public VideoImageProvider {
     int w, h, d;
     size_t length;
     struct npy_info ni;
+    std::shared_ptr<MappedFile> mapping;
+    bool previewed;
 public:
     NumpyVideoImageProvider(const std::string& filename, int index, int w, int h,
-                            int d, size_t length, struct npy_info ni)
-        : VideoImageProvider(filename, index), w(w), h(h), d(d), length(length), ni(ni) {
+                            int d, size_t length, struct npy_info ni,
+                            std::shared_ptr<MappedFile> mapping)
+        : VideoImageProvider(filename, index), w(w), h(h), d(d), length(length), ni(ni),
+          mapping(mapping), previewed(false) {
     }
 
     ~NumpyVideoImageProvider() {
@@ -184,35 +347,124 @@ public:
     }
 
     void progress() {
-        FILE* file = fopen(filename.c_str(), "r");
-        // compute frame position and read it
-        size_t framesize = npy_type_size(ni.type) * w * h * d;
-        long pos = ni.header_offset + frame * framesize;
-        fseek(file, pos, SEEK_SET);
-        void* data = malloc(framesize);
-        if (fread(data, 1, framesize, file) != framesize) {
-            onFinish(makeError("npy: couldn't read frame"));
+        // compute frame position
+        size_t n = (size_t) w * h * d;
+        size_t framesize = npy_type_size(ni.type) * n;
+        size_t pos = ni.header_offset + frame * framesize;
+
+        std::shared_ptr<Image> image;
+        if (mapping) {
+            // a truncated file is an error, as with fread
+            if (pos + framesize > mapping->getSize() || !mapping->isIntact()) {
+                onFinish(makeError("npy: couldn't read frame"));
+                return;
+            }
+            const uint8_t* data = mapping->getData() + pos;
+            size_t samplesize = npy_type_size(ni.type);
+            Image::Type type = Image::F32;
+            bool native = true;
+            if (npy_type_is_float(ni.type))
+                type = Image::F32;
+            else if (npy_type_is_uint8(ni.type))
+                type = Image::U8;
+            else if (npy_type_is_uint16(ni.type))
+                type = Image::U16;
+            else
+                native = false;
+
+            if (native && (uintptr_t) data % samplesize == 0) {
+                // the image points directly into the mapping and keeps it alive
+                image = std::make_shared<Image>((void*) data, type, w, h, d, mapping);
+            } else {
+                float* pixels = (float*) malloc(n * sizeof(float));
+                convertNpySamples(pixels, data, n, ni.type);
+                image = std::make_shared<Image>(pixels, w, h, d);
+            }
+        } else {
+            FILE* file = fopen(filename.c_str(), "r");
+            if (!file) {
+                onFinish(makeError("npy: couldn't open file"));
+                return;
+            }
+            // the mapped frames need no preview, they are not read
+            if (!previewed && wantsPreview(w, h)) {
+                readPreview(file, pos);
+                previewed = true;
+                fclose(file);
+                return;
+            }
+            fseek(file, pos, SEEK_SET);
+            void* data = malloc(framesize);
+            if (fread(data, 1, framesize, file) != framesize) {
+                free(data);
+                fclose(file);
+                onFinish(makeError("npy: couldn't read frame"));
+                return;
+            }
+            fclose(file);
+            // convert to float
+            float* pixels = (float*) data;
+            if (!npy_type_is_float(ni.type)) {
+                pixels = (float*) malloc(n * sizeof(float));
+                convertNpySamples(pixels, data, n, ni.type);
+                free(data);
+            }
+            image = std::make_shared<Image>(pixels, w, h, d);
         }
-        // convert to float
-        float* pixels = npy_convert_to_float(data, w * h * d, ni.type);
-        auto image = std::make_shared<Image>(pixels, w, h, d);
         image->cutChannels();
         onFinish(image);
     }
+
+private:
+    // every 8th pixel of every 8th row, read before the whole frame
+    void readPreview(FILE* file, size_t pos) {
+        size_t samplesize = npy_type_size(ni.type);
+        size_t pixelsize = d * samplesize;
+        size_t rowsize = w * pixelsize;
+        int pw = (w + 7) / 8;
+        int ph = (h + 7) / 8;
+        std::vector<uint8_t> row(rowsize);
+        std::vector<uint8_t> samples((size_t) pw * ph * pixelsize);
+        for (int y = 0; y < ph; y++) {
+            if (fseek(file, pos + (size_t) y * 8 * rowsize, SEEK_SET)
+                || fread(row.data(), 1, rowsize, file) != rowsize)
+                return;
+            for (int x = 0; x < pw; x++) {
+                memcpy(&samples[((size_t) y * pw + x) * pixelsize], &row[(size_t) x * 8 * pixelsize], pixelsize);
+            }
+        }
+        size_t n = (size_t) pw * ph * d;
+        float* pixels = (float*) malloc(n * sizeof(float));
+        convertNpySamples(pixels, samples.data(), n, ni.type);
+        onPreview(std::make_shared<Image>(pixels, pw, ph, d), w, h);
+    }
 };
 
-class NumpyVideoImageCollection : public VideoImageCollection {
+// header of a .npy file and its mapping, replaced as a whole when the file is reloaded
+// so that the providers never see the fields of two versions of the file
+struct NumpyHeader {
     size_t length;
     int w, h, d;
     struct npy_info ni;
+    std::shared_ptr<MappedFile> mapping;
+};
+
+class NumpyVideoImageCollection : public VideoImageCollection {
+    // written by the main thread, read by the loading threads
+    std::shared_ptr<const NumpyHeader> header;
 
-    void loadHeader() {
+    // null if the header cannot be read
+    std::shared_ptr<const NumpyHeader> loadHeader() const {
+        auto header = std::make_shared<NumpyHeader>();
+        struct npy_info& ni = header->ni;
         FILE* file = fopen(filename.c_str(), "r");
-        if (!npy_read_header(file, &ni)) {
+        bool ok = file && npy_read_header(file, &ni);
+        if (file)
+            fclose(file);
+        if (!ok) {
             fprintf(stderr, "[npy] error while loading header\n");
-            exit(1);
+            return nullptr;
         }
-        fclose(file);
 
         if (ni.fortran_order) {
             fprintf(stderr, "numpy array '%s' is fortran order, please ask kidanger for support.\n",
@@ -220,6 +472,10 @@ class NumpyVideoImageCollection : public VideoImageCollection {
             exit(1);
         }
 
+        int& w = header->w;
+        int& h = header->h;
+        int& d = header->d;
+        size_t& length = header->length;
         d = 1;
         length = 1;
         if (ni.ndims == 2) {
@@ -242,38 +498,53 @@ class NumpyVideoImageCollection : public VideoImageCollection {
             d = ni.dims[3];
         }
 
+        header->mapping = std::make_shared<MappedFile>(filename);
+        if (!header->mapping->isValid()) {
+            header->mapping = nullptr;
+        }
+
         printf("opened numpy array '%s', assuming size: (n=%lu, h=%d, w=%d, d=%d), type=%s\n",
                filename.c_str(), length, h, w, d, ni.desc);
+        return header;
     }
 
+    // expires with the collection, the callbacks of the watcher cannot be removed
+    std::shared_ptr<bool> alive;
+
 public:
-    NumpyVideoImageCollection(const std::string& filename) : VideoImageCollection(filename), length(0) {
-        loadHeader();
+    NumpyVideoImageCollection(const std::string& filename)
+        : VideoImageCollection(filename), alive(std::make_shared<bool>(true)) {
+        header = loadHeader();
+        if (!header)
+            exit(1);
+        std::weak_ptr<bool> watched = alive;
+        watcher_add_file(filename, [this,watched](const std::string& fname) {
+            if (watched.expired())
+                return;
+            LOG("file changed " << filename);
+            invalidateFrames(*this, header->length);
+            // a file being rewritten keeps its previous header until the next change
+            std::shared_ptr<const NumpyHeader> reloaded = loadHeader();
+            if (reloaded)
+                std::atomic_store(&header, reloaded);
+        });
     }
 
     ~NumpyVideoImageCollection() {
     }
 
     int getLength() const {
-        return length;
+        return header->length;
     }
 
     std::shared_ptr<ImageProvider> getImageProvider(int index) const {
         std::string key = getKey(index);
-        std::string filename = this->filename;
         auto provider = [&]() {
-            auto provider = std::make_shared<NumpyVideoImageProvider>(filename, index, w, h, d, length, ni);
-            watcher_add_file(filename, [key,this](const std::string& fname) {
-                LOG("file changed " << filename);
-                ImageCache::Error::remove(key);
-                ImageCache::remove(key);
-                gReloadImages = true;
-                // that's ugly
-                ((NumpyVideoImageCollection*) this)->loadHeader();
-            });
-            return provider;
+            std::shared_ptr<const NumpyHeader> h = std::atomic_load(&header);
+            return std::make_shared<NumpyVideoImageProvider>(filename, index, h->w, h->h, h->d, h->length,
+                                                            h->ni, h->mapping);
         };
-        return std::make_shared<CacheImageProvider>(key, provider);
+        return CacheImageProvider::create(key, provider);
     }
 };
 
@@ -152,13 +152,14 @@ public:
 class EditedImageCollection : public ImageCollection {
     EditType edittype;
     std::string editprog;
-    std::vector<ImageCollection*> collections;
+    // the collections of other sequences, kept alive while the edit is displayed
+    std::vector<std::shared_ptr<ImageCollection>> collections;
     int length;
 
 public:
 
     EditedImageCollection(EditType edittype, const std::string& editprog,
-                          const std::vector<ImageCollection*>& collections)
+                          const std::vector<std::shared_ptr<ImageCollection>>& collections)
             : edittype(edittype), editprog(editprog), collections(collections), length(1) {
         if (!collections.empty()) {
             length = collections[0]->getLength();
@@ -169,10 +170,6 @@ public:
     }
 
     virtual ~EditedImageCollection() {
-        for (auto c : collections) {
-            delete c;
-        }
-        collections.clear();
     }
 
     const std::string& getFilename(int index) const {
@@ -205,7 +202,7 @@ class MaskedImageCollection : public ImageCollection {
 
 public:
 
-    MaskedImageCollection(ImageCollection* parent, int masked)
+    MaskedImageCollection(std::shared_ptr<ImageCollection> parent, int masked)
             : parent(parent), masked(masked) {
     }
 
@@ -1,12 +1,24 @@
 #include <errno.h>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <unordered_map>
 
 extern "C" {
 #include "iio.h"
 }
 
 #include "Image.hpp"
+#include "ImagePyramid.hpp"
 #include "editors.hpp"
 #include "ImageProvider.hpp"
+#include "globals.hpp"
+#include "MappedFile.hpp"
+#include "convert.hpp"
+#include "LoadingThread.hpp"
 
 std::shared_ptr<Image> cut_channels(std::shared_ptr<Image> image, const std::string& filename="")
 {
@@ -17,10 +29,48 @@ std::shared_ptr<Image> cut_channels(std::shared_ptr<Image> image, const std::str
     return image;
 }
 
+std::shared_ptr<ImageProvider> CacheImageProvider::create(const std::string& key,
+                                                          std::function<std::shared_ptr<ImageProvider>()> get)
+{
+    // recursive because 'get' can create the providers of edited images
+    static std::recursive_mutex lock;
+    static std::unordered_map<std::string, std::weak_ptr<ImageProvider>> loading;
+    std::lock_guard<std::recursive_mutex> _lock(lock);
+
+    auto i = loading.find(key);
+    if (i != loading.end()) {
+        std::shared_ptr<ImageProvider> provider = i->second.lock();
+        if (provider && !provider->isLoaded()) {
+            return provider;
+        }
+        loading.erase(i);
+    }
+
+    std::shared_ptr<ImageProvider> provider = std::make_shared<CacheImageProvider>(key, get);
+    if (!provider->isLoaded()) {
+        if (loading.size() > 1024) {
+            for (auto it = loading.begin(); it != loading.end(); ) {
+                if (it->second.expired()) {
+                    it = loading.erase(it);
+                } else {
+                    it++;
+                }
+            }
+        }
+        loading[key] = provider;
+    }
+    return provider;
+}
+
 static std::shared_ptr<Image> load_from_iio(const std::string& filename)
 {
+    // iio is not reentrant (global jump buffer, temporary files)
+    static std::mutex lock;
+    std::unique_lock<std::mutex> _lock(lock);
+
     int w, h, d;
     float* pixels = iio_read_image_float_vec(filename.c_str(), &w, &h, &d);
+    _lock.unlock();
     if (!pixels) {
        return nullptr;
     }
@@ -41,34 +91,86 @@ void IIOFileImageProvider::progress()
 #ifdef USE_GDAL
 #include <gdal.h>
 #include <gdal_priv.h>
+GDALFileImageProvider::~GDALFileImageProvider()
+{
+    if (dataset)
+        GDALClose((GDALDataset*) dataset);
+    free(pixels);
+}
+
+// one band of rows per call, the bands in the region of interest first
 void GDALFileImageProvider::progress()
 {
-    GDALDataset* g = (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly);
-    if (!g) {
-        onFinish(makeError("gdal: cannot load image '" + filename + "'"));
+    if (!dataset) {
+        GDALDataset* g = (GDALDataset*) GDALOpen(filename.c_str(), GA_ReadOnly);
+        if (!g) {
+            return onFinish(makeError("gdal: cannot load image '" + filename + "'"));
+        }
+        dataset = g;
+
+        w = g->GetRasterXSize();
+        h = g->GetRasterYSize();
+        d = g->GetRasterCount();
+        if (w <= 0 || h <= 0 || d <= 0) {
+            return onFinish(makeError("gdal: empty image '" + filename + "'"));
+        }
+
+        // whole blocks of rows, about 4M samples
+        int bw, bh;
+        g->GetRasterBand(1)->GetBlockSize(&bw, &bh);
+        bh = std::max(bh, 1);
+        int rows = std::max<size_t>(1, (1 << 22) / ((size_t) w * d));
+        bandh = std::min(h, std::max(bh, rows / bh * bh));
+        done.assign((h + bandh - 1) / bandh, false);
+        pixels = (float*) malloc(sizeof(float) * w * h * d);
+
+        // a reduced read is served by the overviews of the file, if it has some
+        if (wantsPreview(w, h) && g->GetRasterBand(1)->GetOverviewCount() > 0) {
+            int f = std::max(w, h) / 1024 + 1;
+            int pw = (w + f - 1) / f;
+            int ph = (h + f - 1) / f;
+            float* preview = (float*) malloc(sizeof(float) * pw * ph * d);
+            CPLErr err = g->RasterIO(GF_Read, 0, 0, w, h, preview, pw, ph, GDT_Float32, d,
+                                     NULL, sizeof(float)*d, sizeof(float)*pw*d, sizeof(float));
+            if (err == CE_None) {
+                onPreview(std::make_shared<Image>(preview, pw, ph, d), w, h);
+            } else {
+                free(preview);
+            }
+        }
+        return;
     }
 
-    int w = g->GetRasterXSize();
-    int h = g->GetRasterYSize();
-    int d = g->GetRasterCount();
-    float* pixels = (float*) malloc(sizeof(float) * w * h * d);
-    GDALRasterIOExtraArg args;
-    INIT_RASTERIO_EXTRA_ARG(args);
-    args.pfnProgress = [](double d, const char*, void* data){
-        ((GDALFileImageProvider*) data)->df = d;
-        return 1;
-    };
-    args.pProgressData = this;
-    CPLErr err = g->RasterIO(GF_Read, 0, 0, w, h, pixels, w, h, GDT_Float32, d,
-                             NULL, sizeof(float)*d, sizeof(float)*w*d, sizeof(float),
-                             &args);
-    GDALClose(g);
+    size_t x0, y0, x1, y1;
+    getRegionOfInterest().getBounds(w, h, x0, y0, x1, y1);
+    int band = -1;
+    for (int b = y0 / bandh; y1 > y0 && b <= (int) (y1 - 1) / bandh; b++) {
+        if (!done[b]) {
+            band = b;
+            break;
+        }
+    }
+    for (int b = 0; band < 0 && b < (int) done.size(); b++) {
+        if (!done[b]) {
+            band = b;
+        }
+    }
 
+    GDALDataset* g = (GDALDataset*) dataset;
+    int y = band * bandh;
+    int n = std::min(bandh, h - y);
+    CPLErr err = g->RasterIO(GF_Read, 0, y, w, n, pixels + (size_t) y * w * d, w, n, GDT_Float32, d,
+                             NULL, sizeof(float)*d, sizeof(float)*w*d, sizeof(float));
     if (err != CE_None) {
-        onFinish(makeError("gdal: cannot load image '" + filename +
-                           "' err:" + std::to_string(err)));
-    } else {
+        return onFinish(makeError("gdal: cannot load image '" + filename +
+                                  "' err:" + std::to_string(err)));
+    }
+    done[band] = true;
+    ndone++;
+
+    if (ndone == (int) done.size()) {
         std::shared_ptr<Image> image = std::make_shared<Image>(pixels, w, h, d);
+        pixels = nullptr;
         image = cut_channels(image, filename);
         onFinish(image);
     }
@@ -98,11 +200,50 @@ JPEGFileImageProvider::~JPEGFileImageProvider()
     if (jerr) {
         delete jerr;
     }
-    if (pixels) {
-        free(pixels);
+}
+
+#ifdef USE_TURBOJPEG
+#include <turbojpeg.h>
+
+// decodes the whole file at once, straight into the image
+// returns null for the images that are better decoded by rows with libjpeg (large or CMYK images),
+// or if the file cannot be parsed, libjpeg then reports the error
+// 'data' is the mapped file, shared with libjpeg so that the file is not copied
+static std::shared_ptr<Image> decodeTurboJPEG(const uint8_t* data, size_t size, std::string& error)
+{
+    tjhandle handle = tjInitDecompress();
+    if (!handle)
+        return nullptr;
+
+    std::shared_ptr<Image> image;
+    int w, h, subsamp, colorspace;
+    if (!tjDecompressHeader3(handle, (unsigned char*) data, size, &w, &h, &subsamp, &colorspace)
+        && !ImageProvider::wantsPreview(w, h) && colorspace != TJCS_CMYK && colorspace != TJCS_YCCK) {
+        int c = colorspace == TJCS_GRAY ? 1 : 3;
+        unsigned char* pixels = (unsigned char*) malloc((size_t) w * h * c);
+        if (!pixels) {
+            error = "jpeg: out of memory";
+        } else if (tjDecompress2(handle, data, size, pixels, w, 0, h,
+                                 c == 1 ? TJPF_GRAY : TJPF_RGB, 0) && tjGetErrorCode(handle) == TJERR_FATAL) {
+            error = tjGetErrorStr2(handle);
+            free(pixels);
+        } else {
+            image = std::make_shared<Image>(pixels, Image::U8, w, h, c);
+        }
     }
-    if (scanline) {
-        delete[] scanline;
+    tjDestroy(handle);
+    return image;
+}
+#endif
+
+// reads from the start of the file
+void JPEGFileImageProvider::setJPEGSource()
+{
+    if (mapping) {
+        jpeg_mem_src(cinfo, (unsigned char*) mapping->getData(), mapping->getSize());
+    } else {
+        fseek(file, 0, SEEK_SET);
+        jpeg_stdio_src(cinfo, file);
     }
 }
 
@@ -124,11 +265,27 @@ void JPEGFileImageProvider::progress()
 {
     assert(!error);
     if (!cinfo) {
-        file = fopen(filename.c_str(), "rb");
-        if (!file) {
-            onFinish(makeError(strerror(errno)));
-            return;
+        mapping.reset(new MappedFile(filename));
+        if (mapping->isValid()) {
+            mapping->willNeed(0, mapping->getSize());
+        } else {
+            mapping = nullptr;
+            file = fopen(filename.c_str(), "rb");
+            if (!file) {
+                onFinish(makeError(strerror(errno)));
+                return;
+            }
+        }
+
+#ifdef USE_TURBOJPEG
+        if (mapping) {
+            std::string turboerror;
+            std::shared_ptr<Image> image = decodeTurboJPEG(mapping->getData(), mapping->getSize(), turboerror);
+            if (!turboerror.empty()) return onFinish(makeError(turboerror));
+            if (image) return onFinish(image);
         }
+#endif
+
         cinfo = new struct jpeg_decompress_struct;
         cinfo->client_data = this;
         jerr = new jpeg_error_mgr;
@@ -137,32 +294,72 @@ void JPEGFileImageProvider::progress()
         jpeg_create_decompress(cinfo);
         if (error) return;
 
-        jpeg_stdio_src(cinfo, file);
+        setJPEGSource();
         if (error) return;
 
         jpeg_read_header(cinfo, TRUE);
         if (error) return;
 
+        // the DCT scaling gives a preview for a fraction of the cost of the full decode
+        if (wantsPreview(cinfo->image_width, cinfo->image_height)) {
+            cinfo->scale_num = 1;
+            cinfo->scale_denom = 8;
+            jpeg_start_decompress(cinfo);
+            if (error) return;
+
+            size_t rowwidth = cinfo->output_width*cinfo->output_components;
+            unsigned char* preview = (unsigned char*) malloc(rowwidth*cinfo->output_height);
+            if (!preview) return onFinish(makeError("jpeg: out of memory for " + filename));
+            while (cinfo->output_scanline < cinfo->output_height) {
+                unsigned char* row = preview + (size_t)cinfo->output_scanline*rowwidth;
+                jpeg_read_scanlines(cinfo, &row, 1);
+                if (error) {
+                    free(preview);
+                    return;
+                }
+            }
+            onPreview(std::make_shared<Image>(preview, Image::U8, cinfo->output_width,
+                                              cinfo->output_height, cinfo->output_components),
+                      cinfo->image_width, cinfo->image_height);
+
+            // the full decode starts again from the beginning of the file
+            jpeg_abort_decompress(cinfo);
+            setJPEGSource();
+            jpeg_read_header(cinfo, TRUE);
+            if (error) return;
+        }
+
         jpeg_start_decompress(cinfo);
         if (error) return;
 
-        pixels = (float*) malloc(sizeof(float)*cinfo->output_width*cinfo->output_height*cinfo->output_components);
-        scanline = new unsigned char[cinfo->output_width*cinfo->output_components];
+        unsigned char* pixels = (unsigned char*) malloc((size_t) cinfo->output_width*cinfo->output_height*cinfo->output_components);
+        if (!pixels) return onFinish(makeError("jpeg: out of memory for " + filename));
+        image = Image::makePartial(pixels, Image::U8,
+                                   cinfo->output_width, cinfo->output_height, cinfo->output_components);
+        onPartial(image);
     } else if (cinfo->output_scanline < cinfo->output_height) {
-        jpeg_read_scanlines(cinfo, &scanline, 1);
-        if (error) return;
+        // decode directly into the image, the samples are kept as 8 bits
+        // about 1MB of rows per call, libjpeg gives up to rec_outbuf_height rows at a time
         size_t rowwidth = cinfo->output_width*cinfo->output_components;
-        for (size_t j = 0; j < rowwidth; j++) {
-            pixels[(size_t)(cinfo->output_scanline-1)*rowwidth + j] = scanline[j];
+        JDIMENSION end = std::min<size_t>(cinfo->output_height,
+                                          cinfo->output_scanline + std::max<size_t>(16, (1<<20) / rowwidth));
+        JSAMPROW rows[16];
+        while (cinfo->output_scanline < end) {
+            JDIMENSION n = std::min<JDIMENSION>(16, end - cinfo->output_scanline);
+            for (JDIMENSION i = 0; i < n; i++) {
+                rows[i] = (unsigned char*) image->pixels + (size_t)(cinfo->output_scanline+i)*rowwidth;
+            }
+            jpeg_read_scanlines(cinfo, rows, n);
+            if (error) return;
         }
+        image->validRows.store(cinfo->output_scanline, std::memory_order_release);
     } else {
         jpeg_finish_decompress(cinfo);
         if (error) return;
 
-        std::shared_ptr<Image> image = std::make_shared<Image>(pixels,
-                               cinfo->output_width, cinfo->output_height, cinfo->output_components);
+        image->finishPartial();
         onFinish(image);
-        pixels = nullptr;
+        image = nullptr;
     }
 }
 
@@ -178,26 +375,35 @@ struct PNGPrivate {
     int channels;
     int depth;
     uint32_t cur;
-    float* pixels;
+    size_t rowbytes;
     png_bytep pngframe;
 
+    // the file is given to libpng from a mapping, or read in 'buffer' if it cannot be mapped
+    std::unique_ptr<MappedFile> mapping;
+    size_t offset;
     uint32_t length;
     unsigned char* buffer;
 
+    // samples of the first Adam7 pass of an interlaced image, one pixel out of 8x8
+    uint8_t* passframe;
+    std::shared_ptr<Image> preview;
+    // owns 'pngframe' for the non interlaced images, displayed while they are decoded
+    std::shared_ptr<Image> partial;
+
     PNGPrivate(PNGFileImageProvider* provider)
         : provider(provider), file(nullptr), png_ptr(nullptr), info_ptr(nullptr),
-          height(0), pixels(nullptr), pngframe(nullptr),  buffer(nullptr)
+          height(0), rowbytes(0), pngframe(nullptr), offset(0), buffer(nullptr), passframe(nullptr)
     {}
 
     ~PNGPrivate() {
         if (png_ptr) {
             png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
         }
-        if (pngframe) {
+        if (pngframe && !partial) {
             free(pngframe);
         }
-        if (pixels) {
-            free(pixels);
+        if (passframe) {
+            free(passframe);
         }
         if (buffer) {
             free(buffer);
@@ -213,22 +419,85 @@ struct PNGPrivate {
         height = png_get_image_height(png_ptr, info_ptr);
         channels = png_get_channels(png_ptr, info_ptr);
         depth = png_get_bit_depth(png_ptr, info_ptr);
-        pixels = (float*) malloc(sizeof(float)*width*height*channels);
-        pngframe = (png_bytep) malloc(sizeof(*pngframe) * width*height*channels*depth/8);
 
-        if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+        // the rows are decoded in their final format, nothing is converted once the image is read:
+        // the packed samples are unpacked to bytes (not scaled) and the 16 bits samples are swapped
+        if (depth < 8) {
+            png_set_packing(png_ptr);
+            depth = 8;
+        } else if (depth == 16) {
+            // the samples of a png are big-endian, the U16 images are native-endian
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            png_set_swap(png_ptr);
+#elif !defined(__BYTE_ORDER__)
+            const uint16_t one = 1;
+            if (*(const uint8_t*) &one == 1)
+                png_set_swap(png_ptr);
+#endif
+        }
+
+        bool interlaced = png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
+        if (interlaced) {
             png_set_interlace_handling(png_ptr);
+            if (ImageProvider::wantsPreview(width, height)) {
+                passframe = (uint8_t*) malloc(getPassWidth() * ((height + 7) / 8) * channels * depth / 8);
+            }
+        }
+
+        png_read_update_info(png_ptr, info_ptr);
+
+        rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+        pngframe = (png_bytep) malloc(sizeof(*pngframe) * rowbytes*height);
+        if (!interlaced) {
+            partial = Image::makePartial(pngframe, getType(), width, height, channels);
+        }
+    }
+
+    Image::Type getType() const
+    {
+        return depth == 16 ? Image::U16 : Image::U8;
+    }
+
+    size_t getPassWidth() const
+    {
+        return (width + 7) / 8;
+    }
+
+    // the rows of the first pass are expanded to the width of the image, its pixels are every 8 pixels
+    void storePassRow(png_bytep new_row, png_uint_32 row_num)
+    {
+        size_t pixel = channels * depth / 8;
+        size_t pw = getPassWidth();
+        uint8_t* dest = passframe + (row_num / 8) * pw * pixel;
+        for (size_t x = 0; x < pw; x++) {
+            memcpy(dest + x * pixel, new_row + x * 8 * pixel, pixel);
         }
+    }
 
-        png_start_read_image(png_ptr);
+    void publishPass()
+    {
+        size_t pw = getPassWidth();
+        size_t ph = (height + 7) / 8;
+        preview = std::make_shared<Image>(passframe, getType(), pw, ph, channels);
+        passframe = nullptr;
     }
 
     void row_callback(png_bytep new_row, png_uint_32 row_num, int pass)
     {
+        if (passframe) {
+            if (pass == 0 && new_row && row_num % 8 == 0) {
+                storePassRow(new_row, row_num);
+            } else if (pass > 0) {
+                publishPass();
+            }
+        }
         if (new_row) {
-            png_progressive_combine_row(png_ptr, pngframe+row_num*width*channels*depth/8, new_row);
+            png_progressive_combine_row(png_ptr, pngframe+row_num*rowbytes, new_row);
         }
         cur = row_num;
+        if (partial) {
+            partial->validRows.store(row_num + 1, std::memory_order_release);
+        }
     }
 
     void end_callback()
@@ -237,27 +506,14 @@ struct PNGPrivate {
 
     std::shared_ptr<Image> getImage()
     {
-        switch (depth) {
-            case 1:
-            case 8:
-                for (size_t i = 0; i < width*height*channels; i++) {
-                    pixels[i] = *(pngframe + i);
-                }
-                break;
-            case 16:
-                for (size_t i = 0; i < width*height*channels; i++) {
-                    png_byte *b = (pngframe + i * 2);
-                    std::swap(b[0], b[1]);
-                    uint16_t sample = *(uint16_t *)b;
-                    pixels[i] = sample;
-                }
-                break;
-            default:
-                return nullptr;
+        // the decoded frame becomes the image, the samples keep their precision
+        std::shared_ptr<Image> img = partial;
+        if (img) {
+            img->finishPartial();
+        } else if (pngframe) {
+            img = std::make_shared<Image>(pngframe, getType(), width, height, channels);
         }
-
-        auto img = std::make_shared<Image>(pixels, width, height, channels);
-        pixels = nullptr;
+        pngframe = nullptr;
         return img;
     }
 };
@@ -330,10 +586,18 @@ void PNGFileImageProvider::progress()
 {
     if (!p) {
         p = new PNGPrivate(this);
-        p->file = fopen(filename.c_str(), "rb");
-        if (!p->file) {
-            onFinish(makeError(strerror(errno)));
-            return;
+        p->mapping.reset(new MappedFile(filename));
+        if (p->mapping->isValid()) {
+            p->mapping->willNeed(0, p->mapping->getSize());
+        } else {
+            p->mapping = nullptr;
+            p->file = fopen(filename.c_str(), "rb");
+            if (!p->file) {
+                onFinish(makeError(strerror(errno)));
+                return;
+            }
+            p->length = 1<<20;
+            p->buffer = (png_bytep) malloc(sizeof(*p->buffer) * p->length);
         }
 
         int ret = initialize_png_reader();
@@ -342,22 +606,36 @@ void PNGFileImageProvider::progress()
             return;
         }
 
-        p->length = 1<<12;
-        p->buffer = (png_bytep) malloc(sizeof(*p->buffer) * p->length);
         p->cur = 0;
-    } else if (!feof(p->file)) {
-        int read = fread(p->buffer, 1, p->length, p->file);
-
-        if (ferror(p->file)) {
-            onFinish(makeError(strerror(errno)));
-            return;
+    } else if (p->mapping ? p->offset < p->mapping->getSize() : !feof(p->file)) {
+        // about 1MB of the file per call
+        png_bytep data;
+        size_t read;
+        if (p->mapping) {
+            data = (png_bytep) p->mapping->getData() + p->offset;
+            read = std::min<size_t>(1<<20, p->mapping->getSize() - p->offset);
+            p->offset += read;
+        } else {
+            data = p->buffer;
+            read = fread(p->buffer, 1, p->length, p->file);
+            if (ferror(p->file)) {
+                onFinish(makeError(strerror(errno)));
+                return;
+            }
         }
 
         if (setjmp(png_jmpbuf(p->png_ptr))) {
             return;
         }
 
-        png_process_data(p->png_ptr, p->info_ptr, p->buffer, read);
+        png_process_data(p->png_ptr, p->info_ptr, data, read);
+        if (p->preview) {
+            onPreview(p->preview, p->width, p->height);
+            p->preview = nullptr;
+        }
+        if (p->partial) {
+            onPartial(p->partial);
+        }
     } else {
         std::shared_ptr<Image> image = p->getImage();
         if (!image) {
@@ -377,19 +655,31 @@ void PNGFileImageProvider::onPNGError(const std::string& error)
 
 #include <tiffio.h>
 
+// the strips or tiles of the file are decoded by several threads, each with its own handle
 struct TIFFPrivate {
     TIFFFileImageProvider* provider;
     TIFF* tif;
     uint32_t w, h;
     uint16_t spp, bps, fmt;
-    float* data;
-    uint8_t* buf;
-    bool broken;
-    uint32_t curh;
-    int sls;
+    bool separate;
+    Image::Type type;
+    uint8_t* data;
+
+    // strips or tiles, of unitw x unith pixels (padded for the tiles)
+    bool tiled;
+    uint32_t unitw, unith;
+    uint32_t nunits;
+    size_t unitsize;
+    std::vector<bool> done;
+    uint32_t ndone;
+    // handles not used by a thread, one more is opened when a thread finds none
+    std::vector<TIFF*> handles;
+    std::mutex handlesLock;
+    // owns 'data' once created, displayed while it is decoded
+    std::shared_ptr<Image> image;
 
     TIFFPrivate(TIFFFileImageProvider* provider)
-        : provider(provider), tif(nullptr), h(0), data(nullptr), buf(nullptr), curh(0)
+        : provider(provider), tif(nullptr), h(0), data(nullptr), nunits(0), unitsize(0), ndone(0)
     {
     }
 
@@ -398,13 +688,334 @@ struct TIFFPrivate {
         if (tif) {
             TIFFClose(tif);
         }
-        if (data)
+        for (TIFF* t : handles) {
+            TIFFClose(t);
+        }
+        if (data && !image)
             free(data);
-        if (buf)
-            free(buf);
     }
 };
 
+// strips are units as wide as the image
+static uint32_t getTIFFUnitsAcross(const TIFFPrivate* p)
+{
+    return (p->w + p->unitw - 1) / p->unitw;
+}
+
+static uint32_t getTIFFUnitsPerPlane(const TIFFPrivate* p)
+{
+    return p->separate ? p->nunits / p->spp : p->nunits;
+}
+
+// rows above the first unit that is not decoded, in any plane
+static size_t getTIFFValidRows(const TIFFPrivate* p)
+{
+    uint32_t across = getTIFFUnitsAcross(p);
+    uint32_t perplane = getTIFFUnitsPerPlane(p);
+    size_t rows = p->h;
+    for (uint32_t unit = 0; unit < p->nunits; unit++) {
+        if (!p->done[unit])
+            rows = std::min<size_t>(rows, (unit % perplane) / across * p->unith);
+    }
+    return rows;
+}
+
+// up to 'count' units not decoded yet, the ones in the region of interest first
+static std::vector<uint32_t> getNextTIFFUnits(const TIFFPrivate* p, const RegionOfInterest& roi, size_t count)
+{
+    std::vector<uint32_t> units;
+    uint32_t across = getTIFFUnitsAcross(p);
+    uint32_t perplane = getTIFFUnitsPerPlane(p);
+    size_t x0, y0, x1, y1;
+    roi.getBounds(p->w, p->h, x0, y0, x1, y1);
+    if (!roi.isEmpty() && x0 < x1 && y0 < y1) {
+        for (uint32_t plane = 0; plane < p->nunits / perplane; plane++) {
+            for (size_t uy = y0 / p->unith; uy <= (y1 - 1) / p->unith; uy++) {
+                for (size_t ux = x0 / p->unitw; ux <= (x1 - 1) / p->unitw; ux++) {
+                    uint32_t unit = plane * perplane + uy * across + ux;
+                    if (units.size() < count && unit < p->nunits && !p->done[unit])
+                        units.push_back(unit);
+                }
+            }
+        }
+    }
+    for (uint32_t unit = 0; unit < p->nunits && units.size() < count; unit++) {
+        if (!p->done[unit] && std::find(units.begin(), units.end(), unit) == units.end())
+            units.push_back(unit);
+    }
+    return units;
+}
+
+// copies the samples of a decoded strip or tile to their place in the image
+// the samples are converted from 'format' when the image is in float, copied otherwise
+template <typename D>
+static void storeTIFFUnit(const TIFFPrivate* p, uint32_t unit, const uint8_t* buf, convert::Format format)
+{
+    uint32_t perplane = getTIFFUnitsPerPlane(p);
+    uint32_t plane = unit / perplane;
+    uint32_t index = unit % perplane;
+    uint32_t across = getTIFFUnitsAcross(p);
+    uint32_t x0 = (index % across) * p->unitw;
+    uint32_t y0 = (index / across) * p->unith;
+    uint32_t cw = std::min(p->unitw, p->w - x0);
+    uint32_t ch = std::min(p->unith, p->h - y0);
+
+    // samples per pixel in the strip or tile
+    size_t uspp = p->separate ? 1 : p->spp;
+    size_t samplesize = convert::getSampleSize(format);
+    bool tofloat = std::is_same<D, float>::value;
+    D* dest = (D*) p->data;
+    for (uint32_t y = 0; y < ch; y++) {
+        const uint8_t* s = buf + (size_t) y * p->unitw * uspp * samplesize;
+        D* d = dest + ((size_t) (y0 + y) * p->w + x0) * p->spp + plane;
+        if (tofloat && !p->separate) {
+            convert::toFloat(format, s, cw * p->spp, (float*) d);
+        } else if (tofloat) {
+            convert::toFloatInterleaved(format, s, cw, (float*) d, p->spp);
+        } else if (!p->separate) {
+            memcpy(d, s, cw * p->spp * sizeof(D));
+        } else {
+            for (size_t x = 0; x < cw; x++) {
+                d[x * p->spp] = ((const D*) s)[x];
+            }
+        }
+    }
+}
+
+// decodes the strip or tile 'unit' and stores it in the image
+static bool decodeTIFFUnit(const TIFFPrivate* p, TIFF* tif, uint32_t unit, std::vector<uint8_t>& buf)
+{
+    tmsize_t r = p->tiled ? TIFFReadEncodedTile(tif, unit, buf.data(), buf.size())
+                          : TIFFReadEncodedStrip(tif, unit, buf.data(), buf.size());
+    if (r < 0)
+        return false;
+    // readTIFFLayout() only accepts the layouts where a unit holds all the rows read by storeTIFFUnit(),
+    // the last strip can be shorter
+    size_t y0 = (unit % getTIFFUnitsPerPlane(p)) / getTIFFUnitsAcross(p) * p->unith;
+    size_t rows = std::min<size_t>(p->unith, p->h - y0);
+    assert((size_t) r >= rows * p->unitsize / p->unith);
+    (void) rows;
+
+    switch (p->fmt * 100 + p->bps) {
+        case SAMPLEFORMAT_UINT * 100 + 8: storeTIFFUnit<uint8_t>(p, unit, buf.data(), convert::U8); break;
+        case SAMPLEFORMAT_UINT * 100 + 16: storeTIFFUnit<uint16_t>(p, unit, buf.data(), convert::U16); break;
+        case SAMPLEFORMAT_UINT * 100 + 32: storeTIFFUnit<float>(p, unit, buf.data(), convert::U32); break;
+        case SAMPLEFORMAT_INT * 100 + 8: storeTIFFUnit<float>(p, unit, buf.data(), convert::I8); break;
+        case SAMPLEFORMAT_INT * 100 + 16: storeTIFFUnit<float>(p, unit, buf.data(), convert::I16); break;
+        case SAMPLEFORMAT_INT * 100 + 32: storeTIFFUnit<float>(p, unit, buf.data(), convert::I32); break;
+        // the bits of the half floats are kept
+        case SAMPLEFORMAT_IEEEFP * 100 + 16: storeTIFFUnit<uint16_t>(p, unit, buf.data(), convert::F16); break;
+        case SAMPLEFORMAT_IEEEFP * 100 + 32: storeTIFFUnit<float>(p, unit, buf.data(), convert::F32); break;
+        case SAMPLEFORMAT_IEEEFP * 100 + 64: storeTIFFUnit<float>(p, unit, buf.data(), convert::F64); break;
+        default: return false;
+    }
+    return true;
+}
+
+// reads the size, the sample format and the strips or tiles of the current directory
+// returns false if the size is unknown, 'supported' is false for the formats left to iio
+static bool readTIFFLayout(TIFFPrivate* p, bool& supported)
+{
+    int r = 0;
+    r += TIFFGetField(p->tif, TIFFTAG_IMAGEWIDTH, &p->w);
+    r += TIFFGetField(p->tif, TIFFTAG_IMAGELENGTH, &p->h);
+
+    if (r != 2) return false;
+
+    r = TIFFGetField(p->tif, TIFFTAG_SAMPLESPERPIXEL, &p->spp);
+    if (!r)
+        p->spp=1;
+
+    r = TIFFGetField(p->tif, TIFFTAG_BITSPERSAMPLE, &p->bps);
+    if (!r)
+        p->bps=1;
+
+    r = TIFFGetField(p->tif, TIFFTAG_SAMPLEFORMAT, &p->fmt);
+    if (!r)
+        p->fmt = SAMPLEFORMAT_UINT;
+
+    if (p->fmt == SAMPLEFORMAT_COMPLEXINT || p->fmt == SAMPLEFORMAT_COMPLEXIEEEFP) {
+        p->spp *= 2;
+        p->bps /= 2;
+    }
+    if (p->fmt == SAMPLEFORMAT_COMPLEXINT)
+        p->fmt = SAMPLEFORMAT_INT;
+    if (p->fmt == SAMPLEFORMAT_COMPLEXIEEEFP)
+        p->fmt = SAMPLEFORMAT_IEEEFP;
+
+    uint16_t planarity;
+    r = TIFFGetField(p->tif, TIFFTAG_PLANARCONFIG, &planarity);
+    if (r != 1) planarity = PLANARCONFIG_CONTIG;
+    p->separate = planarity == PLANARCONFIG_SEPARATE;
+
+    // the samples are stored with their own precision when possible, the other formats become floats
+    supported = true;
+    if (p->fmt == SAMPLEFORMAT_UINT && p->bps == 8)
+        p->type = Image::U8;
+    else if (p->fmt == SAMPLEFORMAT_UINT && p->bps == 16)
+        p->type = Image::U16;
+    else if (p->fmt == SAMPLEFORMAT_IEEEFP && p->bps == 16)
+        p->type = Image::F16;
+    // exactly the formats of decodeTIFFUnit(), the others (eg. 24 bits integers) are left to iio
+    else if (p->fmt == SAMPLEFORMAT_UINT && p->bps == 32)
+        p->type = Image::F32;
+    else if (p->fmt == SAMPLEFORMAT_INT && (p->bps == 8 || p->bps == 16 || p->bps == 32))
+        p->type = Image::F32;
+    else if (p->fmt == SAMPLEFORMAT_IEEEFP && (p->bps == 32 || p->bps == 64))
+        p->type = Image::F32;
+    else
+        supported = false;
+
+    p->tiled = TIFFIsTiled(p->tif);
+    if (p->tiled) {
+        TIFFGetField(p->tif, TIFFTAG_TILEWIDTH, &p->unitw);
+        TIFFGetField(p->tif, TIFFTAG_TILELENGTH, &p->unith);
+        p->nunits = TIFFNumberOfTiles(p->tif);
+    } else {
+        p->unitw = p->w;
+        TIFFGetFieldDefaulted(p->tif, TIFFTAG_ROWSPERSTRIP, &p->unith);
+        p->unith = std::min(p->unith, p->h);
+        p->nunits = TIFFNumberOfStrips(p->tif);
+    }
+
+    // the chroma subsampled YCbCr units are smaller than their pixels, iio converts them to RGB
+    uint16_t photometric, subx = 1, suby = 1;
+    if (!TIFFGetField(p->tif, TIFFTAG_PHOTOMETRIC, &photometric))
+        photometric = PHOTOMETRIC_MINISBLACK;
+    if (photometric == PHOTOMETRIC_YCBCR)
+        TIFFGetFieldDefaulted(p->tif, TIFFTAG_YCBCRSUBSAMPLING, &subx, &suby);
+    if (subx != 1 || suby != 1)
+        supported = false;
+    // same for any other layout where a unit is not the plain samples of its pixels
+    size_t uspp = p->separate ? 1 : p->spp;
+    p->unitsize = p->tiled ? TIFFTileSize(p->tif) : TIFFStripSize(p->tif);
+    if (p->unitsize != (size_t) p->unitw * p->unith * uspp * p->bps / 8)
+        supported = false;
+    return true;
+}
+
+// decodes all the strips or tiles of the current directory at once
+static std::shared_ptr<Image> decodeTIFFWhole(TIFFPrivate* q)
+{
+    size_t samplesize = q->type == Image::U8 ? 1 : q->type == Image::F32 ? 4 : 2;
+    q->data = (uint8_t*) calloc((size_t) q->w * q->h * q->spp, samplesize);
+    std::vector<uint8_t> buf(q->unitsize);
+    for (uint32_t unit = 0; unit < q->nunits; unit++) {
+        if (!decodeTIFFUnit(q, q->tif, unit, buf)) {
+            free(q->data);
+            q->data = nullptr;
+            return nullptr;
+        }
+    }
+    std::shared_ptr<Image> image = std::make_shared<Image>(q->data, q->type, q->w, q->h, q->spp);
+    q->data = nullptr;
+    return image;
+}
+
+// true if the samples of the directory are decoded without conversion
+static bool isTIFFNative(const TIFFPrivate* p)
+{
+    return p->type != Image::F32 || (p->fmt == SAMPLEFORMAT_IEEEFP && p->bps == 32);
+}
+
+// the largest reduced resolution subfile of a pyramidal tiff that is small enough to be decoded at once
+static std::shared_ptr<Image> readTIFFPreview(const std::string& filename, const TIFFPrivate* full)
+{
+    TIFFPrivate q(nullptr);
+    q.tif = TIFFOpen(filename.c_str(), "rm");
+    if (!q.tif)
+        return nullptr;
+
+    while (TIFFReadDirectory(q.tif)) {
+        uint32_t subfiletype;
+        if (!TIFFGetField(q.tif, TIFFTAG_SUBFILETYPE, &subfiletype) || !(subfiletype & FILETYPE_REDUCEDIMAGE))
+            continue;
+        bool supported;
+        if (!readTIFFLayout(&q, supported) || !supported || q.spp != full->spp || std::max(q.w, q.h) > 2048)
+            continue;
+        return decodeTIFFWhole(&q);
+    }
+    return nullptr;
+}
+
+// tiles of a tiled tiff, decoded on demand
+class TIFFTileSource : public ImageSource {
+    TIFF* tif;
+    size_t w, h, spp, samplesize;
+    std::vector<uint8_t> tile;
+
+public:
+    TIFFTileSource(TIFF* tif, size_t w, size_t h, size_t spp, size_t samplesize, size_t tw, size_t th)
+        : tif(tif), w(w), h(h), spp(spp), samplesize(samplesize), tile(TIFFTileSize(tif))
+    {
+        bw = tw;
+        bh = th;
+    }
+
+    ~TIFFTileSource()
+    {
+        TIFFClose(tif);
+    }
+
+    bool readBlock(size_t bx, size_t by, void* dest)
+    {
+        if (TIFFReadTile(tif, tile.data(), bx * bw, by * bh, 0, 0) < 0)
+            return false;
+        // the tiles on the borders are padded
+        size_t cw = std::min(bw, w - bx * bw);
+        size_t ch = std::min(bh, h - by * bh);
+        size_t pixelsize = spp * samplesize;
+        for (size_t y = 0; y < ch; y++) {
+            memcpy((uint8_t*) dest + y * cw * pixelsize, tile.data() + y * bw * pixelsize, cw * pixelsize);
+        }
+        return true;
+    }
+};
+
+// reduced resolution subfiles of a pyramidal tiff, displayed in place of a tiled image when zoomed out
+// the tiled subfiles are read by blocks too, the others only if they are small enough to be decoded at once
+static std::vector<std::shared_ptr<Image>> readTIFFLevels(const std::string& filename, const TIFFPrivate* full)
+{
+    std::vector<std::shared_ptr<Image>> levels;
+    TIFFPrivate q(nullptr);
+    q.tif = TIFFOpen(filename.c_str(), "rm");
+    if (!q.tif)
+        return levels;
+
+    for (uint16_t dir = 1; TIFFReadDirectory(q.tif); dir++) {
+        uint32_t subfiletype;
+        if (!TIFFGetField(q.tif, TIFFTAG_SUBFILETYPE, &subfiletype) || !(subfiletype & FILETYPE_REDUCEDIMAGE))
+            continue;
+        bool supported;
+        if (!readTIFFLayout(&q, supported) || !supported || q.spp != full->spp || q.type != full->type
+            || !isTIFFNative(&q) || q.w == 0 || q.h == 0 || q.w >= full->w)
+            continue;
+
+        size_t bytes = (size_t) q.w * q.h * q.spp * (q.bps / 8);
+        if (q.tiled && !q.separate) {
+            // the tiles are read from a handle of their own, positioned on the subfile
+            TIFF* tif = TIFFOpen(filename.c_str(), "rm");
+            if (!tif)
+                continue;
+            if (!TIFFSetDirectory(tif, dir)) {
+                TIFFClose(tif);
+                continue;
+            }
+            auto source = std::make_shared<TIFFTileSource>(tif, q.w, q.h, q.spp, q.bps / 8, q.unitw, q.unith);
+            levels.push_back(std::make_shared<Image>(source, q.type, q.w, q.h, q.spp));
+        } else if (bytes <= gCacheLimitMB * 1000000 / 16) {
+            std::shared_ptr<Image> level = decodeTIFFWhole(&q);
+            if (level)
+                levels.push_back(level);
+        }
+    }
+
+    std::sort(levels.begin(), levels.end(), [](const std::shared_ptr<Image>& a, const std::shared_ptr<Image>& b) {
+        return a->w > b->w;
+    });
+    return levels;
+}
+
 TIFFFileImageProvider::~TIFFFileImageProvider()
 {
     if (p) {
@@ -414,8 +1025,8 @@ TIFFFileImageProvider::~TIFFFileImageProvider()
 
 float TIFFFileImageProvider::getProgressPercentage() const
 {
-    if (p && p->h)
-        return (float) p->curh / p->h;
+    if (p && p->nunits)
+        return (float) p->ndone / p->nunits;
     return 0.f;
 }
 
@@ -426,69 +1037,102 @@ void TIFFFileImageProvider::progress()
         p->tif = TIFFOpen(filename.c_str(), "rm");
         if (!p->tif) return onFinish(makeError("cannot read tiff " + filename));
 
-        int r = 0;
-        r += TIFFGetField(p->tif, TIFFTAG_IMAGEWIDTH, &p->w);
-        r += TIFFGetField(p->tif, TIFFTAG_IMAGELENGTH, &p->h);
-
-        if (r != 2) return onFinish(makeError("can not read tiff of unknown size"));
-
-        r = TIFFGetField(p->tif, TIFFTAG_SAMPLESPERPIXEL, &p->spp);
-        if (!r)
-            p->spp=1;
-
-        r = TIFFGetField(p->tif, TIFFTAG_BITSPERSAMPLE, &p->bps);
-        if (!r)
-            p->bps=1;
-
-        r = TIFFGetField(p->tif, TIFFTAG_SAMPLEFORMAT, &p->fmt);
-        if (!r)
-            p->fmt = SAMPLEFORMAT_UINT;
-
-        if (p->fmt == SAMPLEFORMAT_COMPLEXINT || p->fmt == SAMPLEFORMAT_COMPLEXIEEEFP) {
-            p->spp *= 2;
-            p->bps /= 2;
-        }
-        if (p->fmt == SAMPLEFORMAT_COMPLEXINT)
-            p->fmt = SAMPLEFORMAT_INT;
-        if (p->fmt == SAMPLEFORMAT_COMPLEXIEEEFP)
-            p->fmt = SAMPLEFORMAT_IEEEFP;
-
-        uint16_t planarity;
-        r = TIFFGetField(p->tif, TIFFTAG_PLANARCONFIG, &planarity);
-        if (r != 1) planarity = PLANARCONFIG_CONTIG;
-        p->broken = planarity == PLANARCONFIG_SEPARATE;
-
-        uint32_t scanline_size = (p->w * p->spp * p->bps)/8;
-        int rbps = (p->bps/8) ? (p->bps/8) : 1;
-        p->sls = TIFFScanlineSize(p->tif);
-        if ((int)scanline_size != p->sls)
-            fprintf(stderr, "scanline_size,sls = %d,%d\n", (int)scanline_size, p->sls);
-        //assert((int)scanline_size == sls);
-        if (!p->broken)
-            assert((int)scanline_size == p->sls);
-        assert((int)scanline_size >= p->sls);
-        p->data = (float*) malloc(p->w * p->h * p->spp * rbps);
-        p->buf = (uint8_t*) malloc(scanline_size);
-        p->curh = 0;
-
-        if (TIFFIsTiled(p->tif) || p->fmt != SAMPLEFORMAT_IEEEFP || p->broken || rbps != sizeof(float)) {
+        bool supported;
+        if (!readTIFFLayout(p, supported)) return onFinish(makeError("can not read tiff of unknown size"));
+
+        if (!supported) {
             std::shared_ptr<Image> image = load_from_iio(filename);
             if (!image) {
                 onFinish(makeError("iio: cannot load image '" + filename + "'"));
             } else {
                 onFinish(image);
             }
+            return;
+        }
+
+        // large tiled images are decoded tile by tile when displayed
+        bool native = isTIFFNative(p);
+        size_t bytes = (size_t) p->w * p->h * p->spp * (p->bps / 8);
+        if (p->tiled && native && !p->separate && p->spp <= 4
+            && bytes > gCacheLimitMB * 1000000 / 2) {
+            auto source = std::make_shared<TIFFTileSource>(p->tif, p->w, p->h, p->spp, p->bps / 8,
+                                                           p->unitw, p->unith);
+            p->tif = nullptr;
+            std::shared_ptr<Image> image = std::make_shared<Image>(source, p->type, p->w, p->h, p->spp);
+            // the subfiles replace the pyramid that the other images get, building one would read every block
+            std::vector<std::shared_ptr<Image>> levels = readTIFFLevels(filename, p);
+            if (!levels.empty()) {
+                image->pyramid = std::make_shared<ImagePyramid>(image, levels);
+            }
+            return onFinish(image);
+        }
+
+        if (wantsPreview(p->w, p->h)) {
+            std::shared_ptr<Image> preview = readTIFFPreview(filename, p);
+            if (preview) {
+                onPreview(preview, p->w, p->h);
+            }
+        }
+
+        size_t samplesize = p->type == Image::U8 ? 1 : p->type == Image::F32 ? 4 : 2;
+        p->data = (uint8_t*) calloc((size_t) p->w * p->h * p->spp, samplesize);
+        p->done.assign(p->nunits, false);
+        if (p->spp <= 4) {
+            p->image = Image::makePartial(p->data, p->type, p->w, p->h, p->spp);
+            onPartial(p->image);
+        }
+        p->handles.push_back(p->tif);
+        p->tif = nullptr;
+    } else if (p->ndone < p->nunits) {
+        // each call decodes a few units per thread of the loading pool, the idle threads help
+        size_t nthreads = SleepyLoadingThreadPool::getCurrentSize();
+        std::vector<uint32_t> units = getNextTIFFUnits(p, getRegionOfInterest(), nthreads * 4);
+
+        std::atomic<size_t> next(0);
+        std::atomic<bool> failed(false);
+        SleepyLoadingThreadPool::parallelFor(std::min(nthreads, units.size()), [&](size_t) {
+            TIFF* tif = nullptr;
+            {
+                std::lock_guard<std::mutex> _lock(p->handlesLock);
+                if (!p->handles.empty()) {
+                    tif = p->handles.back();
+                    p->handles.pop_back();
+                }
+            }
+            if (!tif)
+                tif = TIFFOpen(filename.c_str(), "rm");
+            // without a handle, the units are left to the other threads or to the next call
+            if (!tif)
+                return;
+            std::vector<uint8_t> buf(p->unitsize);
+            for (size_t i = next++; i < units.size(); i = next++) {
+                if (!decodeTIFFUnit(p, tif, units[i], buf))
+                    failed = true;
+            }
+            std::lock_guard<std::mutex> _lock(p->handlesLock);
+            p->handles.push_back(tif);
+        });
+
+        if (failed) return onFinish(makeError("error reading tiff " + filename));
+        size_t decoded = std::min<size_t>(next, units.size());
+        for (size_t i = 0; i < decoded; i++) {
+            p->done[units[i]] = true;
+        }
+        p->ndone += decoded;
+        if (p->image) {
+            p->image->validRows.store(getTIFFValidRows(p), std::memory_order_release);
         }
-    } else if (p->curh < p->h) {
-        int r = TIFFReadScanline(p->tif, p->buf, p->curh);
-        if (r < 0) onFinish(makeError("error reading tiff row " + std::to_string(p->curh)));
-        memcpy(p->data + p->curh * p->sls/sizeof(float), p->buf, p->sls);
-        p->curh++;
     } else {
-        std::shared_ptr<Image> image = std::make_shared<Image>(p->data, p->w, p->h, p->spp);
+        std::shared_ptr<Image> image = p->image;
+        if (image) {
+            image->finishPartial();
+        } else {
+            image = std::make_shared<Image>(p->data, p->type, p->w, p->h, p->spp);
+        }
         image = cut_channels(image, filename);
         onFinish(image);
         p->data = nullptr;
+        p->image = nullptr;
     }
 }
 
@@ -540,15 +1184,10 @@ void RAWFileImageProvider::progress()
         int w = processor->imgdata.sizes.raw_width;
         int h = processor->imgdata.sizes.raw_height;
         int d = 1;
-        float* data = (float*) malloc(sizeof(float)*w*h*d);
-
-        for (int y = 0; y < h; y++) {
-            for (int x = 0; x < w; x++) {
-                data[y*w+x] = processor->imgdata.rawdata.raw_image[y*w+x];
-            }
-        }
+        uint16_t* data = (uint16_t*) malloc(sizeof(uint16_t)*w*h*d);
+        memcpy(data, processor->imgdata.rawdata.raw_image, sizeof(uint16_t)*w*h*d);
 
-        std::shared_ptr<Image> image = std::make_shared<Image>(data, w, h, d);
+        std::shared_ptr<Image> image = std::make_shared<Image>(data, Image::U16, w, h, d);
         image = cut_channels(image, filename);
         onFinish(image);
     }
@@ -560,7 +1199,15 @@ end:
 void EditedImageProvider::progress() {
     for (auto p : providers) {
         if (!p->isLoaded()) {
-            p->progress();
+            // the provider might be shared with a sequence and loaded by another thread,
+            // which is waited for instead of coming back at once (the pool would spin on this request),
+            // the timeout leaves a chance to preempt this request
+            if (p->claim()) {
+                p->progress();
+                p->release();
+            } else {
+                p->waitForRelease(std::chrono::milliseconds(50));
+            }
             return;
         }
     }
@@ -8,10 +8,14 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
 
 #include "expected.hpp"
 
 #include "Progressable.hpp"
+#include "MappedFile.hpp"
 
 #if 0
 #define LOG(x) \
@@ -26,6 +30,35 @@
 
 struct Image;
 
+// part of an image displayed by a window, decoded first by the providers that read by chunks
+struct RegionOfInterest {
+    // center relative to the size of the image (as View::center)
+    float cx = .5f, cy = .5f;
+    // half of the size of the region in pixels of the image, the whole image if zero
+    float hw = 0.f, hh = 0.f;
+
+    bool isEmpty() const {
+        return hw <= 0.f || hh <= 0.f;
+    }
+
+    // bounds of the region in an image of size w x h, [x0,x1) x [y0,y1)
+    void getBounds(size_t w, size_t h, size_t& x0, size_t& y0, size_t& x1, size_t& y1) const {
+        if (isEmpty()) {
+            x0 = y0 = 0;
+            x1 = w;
+            y1 = h;
+            return;
+        }
+        auto clip = [](float v, size_t max) {
+            return (size_t) std::min(std::max(v, 0.f), (float) max);
+        };
+        x0 = clip(cx * w - hw, w);
+        y0 = clip(cy * h - hh, h);
+        x1 = clip(cx * w + hw + 1.f, w);
+        y1 = clip(cy * h + hh + 1.f, h);
+    }
+};
+
 #include "Image.hpp"
 class ImageProvider : public Progressable {
 public:
@@ -34,6 +67,13 @@ public:
 private:
     bool loaded;
     Result result;
+    // shared between the main thread and the loading thread
+    mutable std::mutex sharedLock;
+    RegionOfInterest roi;
+    std::shared_ptr<Image> preview;
+    size_t previewW = 0, previewH = 0;
+    std::shared_ptr<Image> partial;
+    std::chrono::steady_clock::time_point partialStart;
 
 protected:
     void onFinish(const Result& res) {
@@ -50,6 +90,24 @@ protected:
         return nonstd::make_unexpected<typename Result::error_type>(std::move(e));
     }
 
+    // publishes a reduced version of the image of size w x h, displayed until the image is loaded
+    void onPreview(const std::shared_ptr<Image>& preview, size_t w, size_t h) {
+        std::lock_guard<std::mutex> _lock(sharedLock);
+        this->preview = preview;
+        previewW = w;
+        previewH = h;
+    }
+
+    // publishes the image being decoded, see Image::makePartial
+    // it is displayed only if the decode is slow and there is no reduced preview
+    void onPartial(const std::shared_ptr<Image>& partial) {
+        std::lock_guard<std::mutex> _lock(sharedLock);
+        if (this->partial != partial) {
+            this->partial = partial;
+            partialStart = std::chrono::steady_clock::now();
+        }
+    }
+
 public:
     ImageProvider() : loaded(false) {
         LOG("create provider")
@@ -67,6 +125,34 @@ public:
         return loaded;
     }
 
+    // the images smaller than this are decoded quickly enough without a preview
+    static bool wantsPreview(size_t w, size_t h) {
+        return w * h >= (1 << 22);
+    }
+
+    virtual void setRegionOfInterest(const RegionOfInterest& roi) {
+        std::lock_guard<std::mutex> _lock(sharedLock);
+        this->roi = roi;
+    }
+
+    RegionOfInterest getRegionOfInterest() const {
+        std::lock_guard<std::mutex> _lock(sharedLock);
+        return roi;
+    }
+
+    // reduced version of the image if the provider published one, or the image being decoded
+    // 'w' and 'h' receive the size of the image
+    virtual std::shared_ptr<Image> getPreview(size_t& w, size_t& h) const {
+        std::lock_guard<std::mutex> _lock(sharedLock);
+        if (!preview && partial && std::chrono::steady_clock::now() - partialStart > std::chrono::milliseconds(100)) {
+            w = partial->w;
+            h = partial->h;
+            return partial;
+        }
+        w = previewW;
+        h = previewH;
+        return preview;
+    }
 };
 
 #include "ImageCache.hpp"
@@ -90,16 +176,36 @@ public:
     virtual ~CacheImageProvider() {
     }
 
+    // returns the provider currently loading 'key' if there is one,
+    // so that an image is not decoded twice at the same time
+    static std::shared_ptr<ImageProvider> create(const std::string& key,
+                                                 std::function<std::shared_ptr<ImageProvider>()> get);
+
+    virtual void setRegionOfInterest(const RegionOfInterest& roi) {
+        ImageProvider::setRegionOfInterest(roi);
+        if (provider) {
+            provider->setRegionOfInterest(roi);
+        }
+    }
+
+    virtual std::shared_ptr<Image> getPreview(size_t& w, size_t& h) const {
+        if (provider) {
+            return provider->getPreview(w, h);
+        }
+        return nullptr;
+    }
+
     virtual float getProgressPercentage() const {
-        if (ImageCache::has(key)) {
+        if (isLoaded() || ImageCache::has(key)) {
             return 1.f;
         }
         return provider->getProgressPercentage();
     }
 
     virtual void progress() {
-        if (ImageCache::has(key)) {
-            onFinish(Result(ImageCache::get(key)));
+        std::shared_ptr<Image> image = ImageCache::get(key);
+        if (image) {
+            onFinish(Result(image));
             //printf("/!\\ inconsistent image loading\n");
         } else {
             provider->progress();
@@ -143,16 +249,22 @@ public:
 #ifdef USE_GDAL
 class GDALFileImageProvider : public FileImageProvider {
 private:
-    float df;
+    // GDALDataset*, read by bands of rows
+    void* dataset;
+    float* pixels;
+    int w, h, d;
+    int bandh;
+    std::vector<bool> done;
+    int ndone;
 public:
-    GDALFileImageProvider(const std::string& filename) : FileImageProvider(filename) {
+    GDALFileImageProvider(const std::string& filename)
+        : FileImageProvider(filename), dataset(nullptr), pixels(nullptr), ndone(0) {
     }
 
-    virtual ~GDALFileImageProvider() {
-    }
+    virtual ~GDALFileImageProvider();
 
     virtual float getProgressPercentage() const {
-        return df;
+        return done.empty() ? 0.f : (float) ndone / done.size();
     }
 
     virtual void progress();
@@ -161,16 +273,20 @@ public:
 
 class JPEGFileImageProvider : public FileImageProvider {
     struct jpeg_decompress_struct* cinfo;
+    // the file is read from the mapping when it can be mapped, from 'file' otherwise
+    std::unique_ptr<MappedFile> mapping;
     FILE* file;
-    float* pixels;
-    unsigned char* scanline;
+    // decoded in place, see Image::makePartial
+    std::shared_ptr<Image> image;
     bool error;
     struct jpeg_error_mgr* jerr;
 
+    void setJPEGSource();
+
 public:
     JPEGFileImageProvider(const std::string& filename)
         : FileImageProvider(filename), cinfo(nullptr), file(nullptr),
-          pixels(nullptr), scanline(nullptr), error(false), jerr(nullptr)
+          error(false), jerr(nullptr)
     {
     }
 
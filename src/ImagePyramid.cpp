@@ -0,0 +1,140 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include "ImagePyramid.hpp"
+#include "ImageCache.hpp"
+
+ImagePyramid::ImagePyramid(std::shared_ptr<Image> image)
+    : image(image), w(image->w), h(image->h), c(image->c),
+      ready(0), charged(0), current(nullptr), curw(0), curh(0), cury(0), loaded(false)
+{
+    type = image->type == Image::U8 || image->type == Image::U16 ? image->type : Image::F32;
+
+    size_t n = 0;
+    for (size_t lw = w, lh = h; std::max(lw, lh) > MINSIZE; n++) {
+        lw = (lw + 1) / 2;
+        lh = (lh + 1) / 2;
+    }
+    levels.resize(n);
+    for (size_t k = 1; k <= n; k++) {
+        scales.push_back(1 << k);
+    }
+    loaded = n == 0;
+}
+
+ImagePyramid::ImagePyramid(std::shared_ptr<Image> image, const std::vector<std::shared_ptr<Image>>& levels)
+    : image(image), w(image->w), h(image->h), c(image->c), type(image->type), levels(levels),
+      ready(levels.size()), charged(0), current(nullptr), curw(0), curh(0), cury(0), loaded(true)
+{
+    for (auto& level : levels) {
+        scales.push_back((float) w / level->w);
+        // the tiled levels are charged by their blocks
+        if (!level->isTiled()) {
+            charged += level->w * level->h * level->c * level->getSampleSize();
+        }
+    }
+    ImageCache::charge(charged);
+}
+
+ImagePyramid::~ImagePyramid()
+{
+    free(current);
+    ImageCache::charge(-(long) charged);
+}
+
+float ImagePyramid::getProgressPercentage() const
+{
+    if (loaded || levels.empty()) return 1.f;
+    float level = curh ? (float) cury / curh : 0.f;
+    return (ready + level) / levels.size();
+}
+
+static void storeSamples(const float* values, size_t n, Image::Type type, void* dest)
+{
+    switch (type) {
+        case Image::U8:
+            for (size_t i = 0; i < n; i++) {
+                ((uint8_t*) dest)[i] = lrintf(std::min(std::max(values[i], 0.f), 255.f));
+            }
+            break;
+        case Image::U16:
+            for (size_t i = 0; i < n; i++) {
+                ((uint16_t*) dest)[i] = lrintf(std::min(std::max(values[i], 0.f), 65535.f));
+            }
+            break;
+        default:
+            memcpy(dest, values, n * sizeof(float));
+            break;
+    }
+}
+
+// about a million samples of the current level per call
+void ImagePyramid::progress()
+{
+    std::shared_ptr<Image> image = this->image.lock();
+    size_t k = ready;
+    if (!image || k >= levels.size()) {
+        loaded = true;
+        return;
+    }
+
+    std::shared_ptr<Image> src = k == 0 ? image : levels[k-1];
+    size_t samplesize = type == Image::U8 ? 1 : type == Image::U16 ? 2 : 4;
+    if (!current) {
+        curw = (src->w + 1) / 2;
+        curh = (src->h + 1) / 2;
+        cury = 0;
+        current = malloc(curw * curh * c * samplesize);
+    }
+
+    // the last row and column are repeated for odd sizes
+    size_t sw = src->w;
+    std::vector<float> row0(sw * c), row1(sw * c), out(curw * c);
+    size_t rows = std::max<size_t>(1, (1 << 20) / (curw * c));
+    size_t end = std::min(curh, cury + rows);
+    for (size_t y = cury; y < end; y++) {
+        src->readSamples(2 * y * sw * c, sw * c, row0.data());
+        if (2 * y + 1 < src->h) {
+            src->readSamples((2 * y + 1) * sw * c, sw * c, row1.data());
+        } else {
+            row1 = row0;
+        }
+        for (size_t x = 0; x < curw; x++) {
+            size_t x0 = 2 * x * c;
+            size_t x1 = std::min(2 * x + 1, sw - 1) * c;
+            for (size_t d = 0; d < c; d++) {
+                out[x*c+d] = (row0[x0+d] + row0[x1+d] + row1[x0+d] + row1[x1+d]) * .25f;
+            }
+        }
+        storeSamples(out.data(), curw * c, type, (uint8_t*) current + y * curw * c * samplesize);
+    }
+    cury = end;
+
+    if (cury == curh) {
+        std::shared_ptr<Image> level = std::make_shared<Image>(current, type, curw, curh, c);
+        current = nullptr;
+        levels[k] = level;
+        charged += curw * curh * c * samplesize;
+        ImageCache::charge(curw * curh * c * samplesize);
+        ready = k + 1;
+        loaded = ready == levels.size();
+    }
+}
+
+std::shared_ptr<Image> ImagePyramid::getLevel(float zoom, float& scale) const
+{
+    if (!isUsedAt(zoom))
+        return nullptr;
+    // the most reduced level whose texels are not larger than a pixel of the screen
+    for (size_t k = ready; k > 0; k--) {
+        if (scales[k-1] <= 1.f / zoom) {
+            scale = scales[k-1];
+            return levels[k-1];
+        }
+    }
+    return nullptr;
+}
+
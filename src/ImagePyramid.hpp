@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include "Progressable.hpp"
+#include "Image.hpp"
+
+// reduced resolutions of a large image, displayed instead of the image when zoomed out
+// the level k is 2^k times smaller than the image, each level averages 2x2 blocks of the previous one
+// the levels can also be given by the file (eg. the reduced subfiles of a tiled tiff), with any sizes
+class ImagePyramid : public Progressable {
+    std::weak_ptr<Image> image;
+    size_t w, h, c;
+    // integer samples stay integers, the others become floats
+    Image::Type type;
+
+    // levels[k-1] is the level k, published once complete
+    std::vector<std::shared_ptr<Image>> levels;
+    // size of a texel of each level in pixels of the image
+    std::vector<float> scales;
+    std::atomic<size_t> ready;
+    // size of the published levels, charged to the image cache
+    size_t charged;
+
+    // level being reduced
+    void* current;
+    size_t curw, curh;
+    size_t cury;
+    std::atomic<bool> loaded;
+
+public:
+    // the levels are reduced until they fit in this size
+    static const size_t MINSIZE = 1024;
+
+    static bool isUseful(const Image& image) {
+        return std::max(image.w, image.h) > 2 * MINSIZE;
+    }
+
+    // true if a level is displayed at this zoom, see getLevel()
+    static bool isUsedAt(float zoom) {
+        return zoom > 0.f && zoom < .5f;
+    }
+
+    ImagePyramid(std::shared_ptr<Image> image);
+    // pyramid made of existing levels, from the largest to the smallest
+    ImagePyramid(std::shared_ptr<Image> image, const std::vector<std::shared_ptr<Image>>& levels);
+    ~ImagePyramid();
+
+    float getProgressPercentage() const;
+
+    bool isLoaded() const {
+        return loaded;
+    }
+
+    void progress();
+
+    // the most reduced level that keeps a texel smaller than a screen pixel at this zoom
+    // 'scale' receives the size of a texel of the level in pixels of the image
+    // returns null if no level is small enough or ready
+    std::shared_ptr<Image> getLevel(float zoom, float& scale) const;
+
+    // the most reduced level that is ready, null if none
+    std::shared_ptr<Image> getSmallestLevel() const {
+        size_t k = ready;
+        return k ? levels[k-1] : nullptr;
+    }
+};
+
@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "events.hpp"
 #include "globals.hpp"
 #include "Progressable.hpp"
@@ -88,3 +90,250 @@ void SleepyLoadingThread::run()
     }
 }
 
+// pool of the calling thread, if it is a thread of a pool
+static thread_local SleepyLoadingThreadPool* currentPool = nullptr;
+
+void SleepyLoadingThreadPool::schedule(std::vector<Request> reqs)
+{
+    std::stable_sort(reqs.begin(), reqs.end(), [](const Request& a, const Request& b) {
+        return a.priority < b.priority;
+    });
+
+    std::lock_guard<std::mutex> lk(m);
+
+    std::unordered_map<std::string, Priority> newrequested;
+    std::vector<Request> newrequests;
+    for (auto& r : reqs) {
+        if (newrequested.insert(std::make_pair(r.id, r.priority)).second) {
+            newrequests.push_back(r);
+        }
+    }
+
+    bool same = newrequests.size() == requests.size();
+    for (size_t i = 0; same && i < requests.size(); i++) {
+        same = requests[i].id == newrequests[i].id && requests[i].priority == newrequests[i].priority;
+    }
+    if (same) {
+        return;
+    }
+
+    for (auto it = suspended.begin(); it != suspended.end(); ) {
+        if (!newrequested.count(it->first)) {
+            it = suspended.erase(it);
+        } else {
+            it++;
+        }
+    }
+    for (auto it = finished.begin(); it != finished.end(); ) {
+        if (!newrequested.count(*it)) {
+            it = finished.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    requests = newrequests;
+    requested = newrequested;
+    generation++;
+    cv.notify_all();
+}
+
+bool SleepyLoadingThreadPool::take(std::string& id, Priority& priority,
+                                   std::shared_ptr<Progressable>& p, unsigned& seen)
+{
+    std::unique_lock<std::mutex> lk(m);
+    seen = generation;
+
+    // keep one thread for the visible images
+    size_t lowPriorityThreads = 0;
+    for (auto& a : active) {
+        lowPriorityThreads += a.second != VISIBLE;
+    }
+    size_t maxLowPriorityThreads = std::max<size_t>(1, threads.size() - 1);
+
+    for (size_t i = 0; i < requests.size(); i++) {
+        Request r = requests[i];
+        if (active.count(r.id) || finished.count(r.id))
+            continue;
+        if (r.priority != VISIBLE && lowPriorityThreads >= maxLowPriorityThreads)
+            break;
+
+        active[r.id] = r.priority;
+        auto s = suspended.find(r.id);
+        if (s != suspended.end()) {
+            p = s->second;
+            suspended.erase(s);
+        } else {
+            // the creation can be slow (it might open the file), so do not block the other threads
+            lk.unlock();
+            p = r.create();
+            lk.lock();
+        }
+
+        if (p && !p->isLoaded() && p->claim()) {
+            id = r.id;
+            priority = r.priority;
+            return true;
+        }
+
+        active.erase(r.id);
+        // histograms are reset by new requests, so they stay schedulable
+        if (r.priority != STATS) {
+            finished.insert(r.id);
+        }
+        p = nullptr;
+        // the requests might have changed while unlocked
+        if (seen != generation) {
+            seen = generation;
+            i = (size_t) -1;
+        }
+    }
+    return false;
+}
+
+bool SleepyLoadingThreadPool::shouldStop(const std::string& id, Priority& priority,
+                                         std::shared_ptr<Progressable>& p, unsigned& seen)
+{
+    std::lock_guard<std::mutex> lk(m);
+
+    if (p->isLoaded()) {
+        if (priority != STATS) {
+            finished.insert(id);
+        }
+        active.erase(id);
+        p->release();
+        return true;
+    }
+
+    if (seen == generation) {
+        return false;
+    }
+    seen = generation;
+
+    auto r = requested.find(id);
+    if (r == requested.end()) {
+        // cancelled (after a seek for example)
+        active.erase(id);
+        p->release();
+        return true;
+    }
+    priority = active[id] = r->second;
+
+    // yield to a request of higher priority
+    for (auto& req : requests) {
+        if (req.priority >= priority)
+            break;
+        if (!active.count(req.id) && !finished.count(req.id)) {
+            suspended[id] = p;
+            active.erase(id);
+            p->release();
+            return true;
+        }
+    }
+    return false;
+}
+
+// called with 'm' held
+bool SleepyLoadingThreadPool::hasPendingJob() const
+{
+    for (auto& job : jobs) {
+        if (job->next < job->n)
+            return true;
+    }
+    return false;
+}
+
+void SleepyLoadingThreadPool::runJob(Job& job)
+{
+    for (size_t i = job.next++; i < job.n; i = job.next++) {
+        job.f(i);
+        if (++job.done == job.n) {
+            std::lock_guard<std::mutex> lk(job.m);
+            job.cv.notify_all();
+        }
+    }
+}
+
+// takes part in the work of a parallelFor() of another thread
+bool SleepyLoadingThreadPool::help()
+{
+    std::shared_ptr<Job> job;
+    {
+        std::lock_guard<std::mutex> lk(m);
+        for (auto& j : jobs) {
+            if (j->next < j->n) {
+                job = j;
+                break;
+            }
+        }
+    }
+    if (!job)
+        return false;
+    runJob(*job);
+    return true;
+}
+
+void SleepyLoadingThreadPool::parallelFor(size_t n, const std::function<void(size_t)>& f)
+{
+    SleepyLoadingThreadPool* pool = currentPool;
+    if (!pool || n <= 1) {
+        for (size_t i = 0; i < n; i++) {
+            f(i);
+        }
+        return;
+    }
+
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->f = f;
+    job->n = n;
+    job->next = 0;
+    job->done = 0;
+    {
+        std::lock_guard<std::mutex> lk(pool->m);
+        pool->jobs.push_back(job);
+    }
+    pool->cv.notify_all();
+
+    runJob(*job);
+    {
+        std::lock_guard<std::mutex> lk(pool->m);
+        pool->jobs.erase(std::find(pool->jobs.begin(), pool->jobs.end(), job));
+    }
+    // the items taken by the other threads might still be running
+    std::unique_lock<std::mutex> lk(job->m);
+    job->cv.wait(lk, [&]{ return job->done == job->n; });
+}
+
+size_t SleepyLoadingThreadPool::getCurrentSize()
+{
+    return currentPool ? currentPool->nthreads : 1;
+}
+
+void SleepyLoadingThreadPool::run()
+{
+    std::string id;
+    Priority priority;
+    std::shared_ptr<Progressable> p;
+    unsigned seen = 0;
+    currentPool = this;
+    while (running) {
+        if (p) {
+            p->progress();
+            // refresh the screen if the progress is displayed
+            if (priority == VISIBLE || priority == PYRAMIDS || priority == STATS) {
+                gActive = std::max(gActive, 2);
+            }
+            if (shouldStop(id, priority, p, seen)) {
+                p = nullptr;
+            }
+            continue;
+        }
+
+        if (!take(id, priority, p, seen)) {
+            if (help())
+                continue;
+            std::unique_lock<std::mutex> lk(m);
+            cv.wait(lk, [&]{ return generation != seen || !running || hasPendingJob(); });
+        }
+    }
+}
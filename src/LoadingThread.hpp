@@ -2,7 +2,12 @@
 
 #include <thread>
 #include <queue>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <memory>
+#include <atomic>
 #include <functional>
 
 class Progressable;
@@ -82,4 +87,103 @@ public:
 
 };
 
+// several threads loading the requests given to schedule(), by order of priority
+// a Progressable is progressed only by the thread that claimed it,
+// but its progress() can share work with the idle threads through parallelFor()
+class SleepyLoadingThreadPool {
+public:
+    enum Priority {
+        VISIBLE,    // images currently displayed
+        UPCOMING,   // next frames of the players
+        PYRAMIDS,   // reduced resolutions of the displayed images, while zoomed out
+        PREFETCH,   // frames further away
+        STATS,      // histograms
+    };
+
+    struct Request {
+        std::string id;
+        Priority priority;
+        std::function<std::shared_ptr<Progressable>()> create;
+    };
+
+private:
+    // work of a parallelFor(), taken by the idle threads
+    struct Job {
+        std::function<void(size_t)> f;
+        size_t n;
+        std::atomic<size_t> next;
+        std::atomic<size_t> done;
+        std::mutex m;
+        std::condition_variable cv;
+    };
+
+    bool running;
+    size_t nthreads;
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable cv;
+    unsigned generation;
+
+    // sorted by priority
+    std::vector<Request> requests;
+    std::unordered_map<std::string, Priority> requested;
+    // requests currently progressed by a thread
+    std::unordered_map<std::string, Priority> active;
+    // requests loaded since they were scheduled, so that an image that did not fit
+    // in the cache is not loaded again and again
+    std::unordered_set<std::string> finished;
+    // requests preempted by requests of higher priority
+    std::unordered_map<std::string, std::shared_ptr<Progressable>> suspended;
+    std::vector<std::shared_ptr<Job>> jobs;
+
+    bool take(std::string& id, Priority& priority, std::shared_ptr<Progressable>& p, unsigned& seen);
+    bool shouldStop(const std::string& id, Priority& priority, std::shared_ptr<Progressable>& p, unsigned& seen);
+    bool hasPendingJob() const;
+    bool help();
+    static void runJob(Job& job);
+
+    void run();
+
+public:
+
+    SleepyLoadingThreadPool() : running(false), nthreads(0), generation(0) {
+    }
+
+    void start(size_t n) {
+        running = true;
+        nthreads = n;
+        for (size_t i = 0; i < n; i++) {
+            threads.push_back(std::thread(&SleepyLoadingThreadPool::run, this));
+        }
+    }
 
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            running = false;
+        }
+        cv.notify_all();
+    }
+
+    void join() {
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    // replaces the current requests, the ones not listed anymore are cancelled
+    void schedule(std::vector<Request> requests);
+
+    size_t size() const {
+        return threads.size();
+    }
+
+    // runs f(0) ... f(n-1) on the calling thread and on the idle threads of its pool, returns once all are done
+    // the decoders of all the requests share the threads of the pool instead of starting their own,
+    // outside of a thread of a pool everything runs on the calling thread
+    static void parallelFor(size_t n, const std::function<void(size_t)>& f);
+
+    // number of threads of the pool of the calling thread, 1 outside of a pool
+    static size_t getCurrentSize();
+
+};
@@ -0,0 +1,144 @@
+#ifndef WINDOWS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include "MappedFile.hpp"
+
+#ifndef WINDOWS
+// the live mappings, read by the SIGBUS handler so they are kept in plain atomics
+static const int MAX_MAPPINGS = 1024;
+static std::atomic<uintptr_t> mappingStarts[MAX_MAPPINGS];
+static std::atomic<uintptr_t> mappingEnds[MAX_MAPPINGS];
+static size_t pageSize;
+static struct sigaction previousAction;
+
+// a page of a mapping removed by a truncation of its file is replaced by a page of zeros,
+// the faulting read then runs again; the other faults go to the previous handler
+static void onSIGBUS(int sig, siginfo_t* info, void* context)
+{
+    uintptr_t addr = (uintptr_t) info->si_addr;
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        if (mappingStarts[i] <= addr && addr < mappingEnds[i]) {
+            void* page = (void*) (addr - addr % pageSize);
+            if (mmap(page, pageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+                return;
+            break;
+        }
+    }
+    if (previousAction.sa_flags & SA_SIGINFO) {
+        previousAction.sa_sigaction(sig, info, context);
+    } else if (previousAction.sa_handler != SIG_DFL && previousAction.sa_handler != SIG_IGN) {
+        previousAction.sa_handler(sig);
+    } else {
+        // the fault happens again with the default action
+        signal(SIGBUS, SIG_DFL);
+    }
+}
+
+static bool registerMapping(uint8_t* data, size_t size)
+{
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        pageSize = sysconf(_SC_PAGESIZE);
+        struct sigaction action = {};
+        action.sa_sigaction = onSIGBUS;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGBUS, &action, &previousAction);
+    });
+
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        uintptr_t none = 0;
+        if (mappingStarts[i].compare_exchange_strong(none, (uintptr_t) data)) {
+            mappingEnds[i] = (uintptr_t) data + size;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void unregisterMapping(uint8_t* data)
+{
+    for (int i = 0; i < MAX_MAPPINGS; i++) {
+        if (mappingStarts[i] == (uintptr_t) data) {
+            mappingEnds[i] = 0;
+            mappingStarts[i] = 0;
+            return;
+        }
+    }
+}
+#endif
+
+MappedFile::MappedFile(const std::string& filename)
+    : data(nullptr), size(0), fd(-1)
+{
+#ifndef WINDOWS
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr != MAP_FAILED) {
+            data = (uint8_t*) ptr;
+            size = st.st_size;
+        }
+    }
+    // too many mappings to protect them, the file is read without one
+    if (data && !registerMapping(data, size)) {
+        munmap(data, size);
+        data = nullptr;
+        size = 0;
+    }
+    // the descriptor is kept to check the size of the file, see isIntact()
+    if (!data) {
+        close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef WINDOWS
+    if (data) {
+        unregisterMapping(data);
+        munmap(data, size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+#endif
+}
+
+bool MappedFile::isIntact() const
+{
+#ifndef WINDOWS
+    struct stat st;
+    return data && fstat(fd, &st) == 0 && (size_t) st.st_size >= size;
+#else
+    return false;
+#endif
+}
+
+void MappedFile::willNeed(size_t offset, size_t length) const
+{
+    if (!data || offset >= size)
+        return;
+    length = std::min(length, size - offset);
+#ifndef WINDOWS
+    // madvise requires a page-aligned address
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    size_t start = offset - offset % pagesize;
+    madvise(data + start, length + (offset - start), MADV_WILLNEED);
+#endif
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// read-only memory mapping of a whole file
+// the mapping is shared: the images that are views into it see the changes to the file, and
+// the collections of mapped files drop all their frames when the watcher reports a change
+// the pages that a truncation removed read as zeros instead of raising SIGBUS (see the handler
+// in MappedFile.cpp), so the views still held by the threads stay readable until they are dropped
+class MappedFile {
+    uint8_t* data;
+    size_t size;
+    int fd;
+
+public:
+    MappedFile(const std::string& filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isValid() const {
+        return data != nullptr;
+    }
+
+    const uint8_t* getData() const {
+        return data;
+    }
+
+    size_t getSize() const {
+        return size;
+    }
+
+    // false once the file is shorter than the mapping, the frames are then read as errors
+    bool isIntact() const;
+
+    // asks the kernel to start reading the given range in the background
+    void willNeed(size_t offset, size_t length) const;
+};
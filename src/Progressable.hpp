@@ -1,9 +1,48 @@
 #pragma once
 
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+
 class Progressable {
+    std::atomic<bool> claimed;
+    // signals release() to waitForRelease()
+    std::mutex m;
+    std::condition_variable cv;
+
 public:
+    Progressable() : claimed(false) {
+    }
+
+    virtual ~Progressable() {
+    }
+
     virtual float getProgressPercentage() const = 0;
     virtual bool isLoaded() const = 0;
     virtual void progress() = 0;
-};
 
+    // ensures that a single thread calls progress() at a time
+    bool claim() {
+        return !claimed.exchange(true);
+    }
+
+    void release() {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            claimed = false;
+        }
+        cv.notify_all();
+    }
+
+    // sleeps until the thread that claimed it releases it, or for at most 'timeout'
+    // the thread claiming it keeps it until it is loaded or preempted
+    void waitForRelease(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait_for(lk, timeout, [&]{ return !claimed; });
+    }
+
+    bool isClaimed() const {
+        return claimed;
+    }
+};
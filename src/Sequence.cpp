@@ -22,6 +22,8 @@
 #include "globals.hpp"
 #include "SVG.hpp"
 #include "Histogram.hpp"
+#include "HistogramIndex.hpp"
+#include "ImagePyramid.hpp"
 #include "editors.hpp"
 #include "shaders.hpp"
 #include "EditGUI.hpp"
@@ -129,7 +131,7 @@ void Sequence::loadFilenames() {
         filenames.push_back("-");
     }
 
-    ImageCollection* col = buildImageCollectionFromFilenames(filenames);
+    std::shared_ptr<ImageCollection> col(buildImageCollectionFromFilenames(filenames));
     this->collection = col;
     this->uneditedCollection = col;
 
@@ -181,17 +183,40 @@ void Sequence::tick()
         }
         gActive = std::max(gActive, 2);
         imageprovider = nullptr;
+        preview = nullptr;
+        // the index and the pyramid would read every block of a tiled image,
+        // its histogram is taken from an overview, see Image::getOverview()
+        if (image && !image->isTiled()) {
+            if (!image->histogramIndex) {
+                image->histogramIndex = std::make_shared<HistogramIndex>(image);
+            }
+            if (!image->pyramid && ImagePyramid::isUseful(*image)) {
+                image->pyramid = std::make_shared<ImagePyramid>(image);
+            }
+        }
         if (image) {
             image->histogram->request(image, image->min, image->max,
                                       gSmoothHistogram ? Histogram::SMOOTH : Histogram::EXACT);
         }
     }
 
-    if (image && colormap && !colormap->initialized) {
-        colormap->autoCenterAndRadius(image->min, image->max);
+    // the preview is displayed until the image is loaded
+    if (imageprovider && !imageprovider->isLoaded() && !image) {
+        size_t w, h;
+        std::shared_ptr<Image> p = imageprovider->getPreview(w, h);
+        if (p && p != preview) {
+            preview = p;
+            previewSize = ImVec2(w, h);
+            gActive = std::max(gActive, 2);
+        }
+    }
 
+    // the preview has about the same range as the image,
+    // the range of a partially decoded image is not known yet
+    std::shared_ptr<Image> shown = image ? image : preview;
+    if (shown && colormap && !colormap->initialized) {
         if (!colormap->shader) {
-            switch (image->c) {
+            switch (shown->c) {
                 case 1:
                     colormap->shader = getShader("gray");
                     break;
@@ -205,7 +230,10 @@ void Sequence::tick()
                     break;
             }
         }
-        colormap->initialized = true;
+        if (!shown->isPartial()) {
+            colormap->autoCenterAndRadius(shown->min, shown->max);
+            colormap->initialized = true;
+        }
     }
 }
 
@@ -213,6 +241,7 @@ void Sequence::forgetImage()
 {
     LOG("forget image, was=" << image << " provider=" << imageprovider);
     image = nullptr;
+    preview = nullptr;
     if (player && collection && player->frame - 1 >= 0
         && player->frame - 1 < collection->getLength()) {
         imageprovider = collection->getImageProvider(player->frame - 1);
@@ -246,35 +275,47 @@ void Sequence::autoScaleAndBias(ImVec2 p1, ImVec2 p2, float quantile)
             return;
     }
 
+    // a large region of a tiled image is sampled instead of reading all its blocks
+    if (img->isTiled() && !(quantile == 0 && norange)) {
+        ImRect region = norange ? ImRect(0, 0, img->w, img->h) : ImRect(p1, p2);
+        std::shared_ptr<Image> overview = img->getOverview(region);
+        if (overview) {
+            img = overview;
+            p1 = region.Min;
+            p2 = region.Max;
+            norange = false;
+        }
+    }
+
     if (quantile == 0) {
         if (norange) {
             low = img->min;
             high = img->max;
+        } else if (img->histogramIndex && img->histogramIndex->isLoaded()) {
+            img->histogramIndex->getBounds(ImRect(p1, p2), low, high);
         } else {
-            const float* data = (const float*) img->pixels;
+            std::vector<float> row(std::max(0, (int)p2.x - (int)p1.x) * img->c);
             for (int y = p1.y; y < p2.y; y++) {
-                for (int x = p1.x; x < p2.x; x++) {
-                    for (int d = 0; d < img->c; d++) {
-                        float v = data[d + img->c*(x+y*img->w)];
-                        if (std::isfinite(v)) {
-                            low = std::min(low, v);
-                            high = std::max(high, v);
-                        }
+                img->readSamples(img->c*((int)p1.x+y*img->w), row.size(), row.data());
+                for (float v : row) {
+                    if (std::isfinite(v)) {
+                        low = std::min(low, v);
+                        high = std::max(high, v);
                     }
                 }
             }
         }
     } else {
         std::vector<float> all;
-        const float* data = (const float*) img->pixels;
         if (norange) {
-            all = std::vector<float>(data, data+img->w*img->h*img->c);
+            all.resize(img->w*img->h*img->c);
+            img->readSamples(0, all.size(), all.data());
         } else {
+            // XXX: might be off by one, who knows
+            size_t rowsize = std::max(0, (int)p2.x - (int)p1.x) * img->c;
             for (int y = p1.y; y < p2.y; y++) {
-                const float* start = &data[0 + img->c*((int)p1.x+y*img->w)];
-                // XXX: might be off by one, who knows
-                const float* end = &data[0 + img->c*((int)p2.x+y*img->w)];
-                all.insert(all.end(), start, end);
+                all.resize(all.size() + rowsize);
+                img->readSamples(img->c*((int)p1.x+y*img->w), rowsize, all.data() + all.size() - rowsize);
             }
         }
         all.erase(std::remove_if(all.begin(), all.end(),
@@ -452,7 +493,7 @@ void Sequence::removeCurrentFrame()
         return;
     }
     int index = player->frame - 1;
-    collection = new MaskedImageCollection(uneditedCollection, index);
+    collection = std::make_shared<MaskedImageCollection>(uneditedCollection, index);
     uneditedCollection = collection;
     editGUI->validate(*this);
     player->reconfigureBounds();
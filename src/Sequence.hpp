@@ -25,7 +25,7 @@ struct Sequence {
     std::string glob;
     std::string glob_;
 
-    ImageCollection* collection;
+    std::shared_ptr<ImageCollection> collection;
     std::vector<std::string> svgglobs;
     std::vector<std::vector<std::string>> svgcollection;
     bool valid;
@@ -38,9 +38,12 @@ struct Sequence {
     Colormap* colormap;
     std::shared_ptr<ImageProvider> imageprovider;
     std::shared_ptr<Image> image;
+    // reduced version of the image being loaded, and the size of the image
+    std::shared_ptr<Image> preview;
+    ImVec2 previewSize;
     std::string error;
 
-    ImageCollection* uneditedCollection;
+    std::shared_ptr<ImageCollection> uneditedCollection;
     EditGUI* editGUI;
 
     Sequence();
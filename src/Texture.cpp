@@ -1,8 +1,18 @@
 #include <list>
+#include <deque>
+#include <unordered_map>
 #include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
 
 #ifndef SDL
-#include <SFML/OpenGL.hpp>
+#include <GL/glew.h>
 #else
 #include <GL/gl3w.h>
 #endif
@@ -37,31 +47,39 @@ const char* getGLError(GLenum error)
     } \
 }
 
-static std::list<TextureTile> tileCache;
+static GLuint getInternalFormat(unsigned format, unsigned type)
+{
+    static const GLuint formats[][4] = {
+        {GL_R8, GL_RG8, GL_RGB8, GL_RGBA8},
+        {GL_R16, GL_RG16, GL_RGB16, GL_RGBA16},
+        {GL_R16F, GL_RG16F, GL_RGB16F, GL_RGBA16F},
+        {GL_R32F, GL_RG32F, GL_RGB32F, GL_RGBA32F},
+    };
+    int precision;
+    switch (type) {
+        case GL_UNSIGNED_BYTE: precision = 0; break;
+        case GL_UNSIGNED_SHORT: precision = 1; break;
+        case GL_HALF_FLOAT: precision = 2; break;
+        case GL_FLOAT: precision = 3; break;
+        default: assert(0);
+    }
+    switch (format) {
+        case GL_RED: return formats[precision][0];
+        case GL_RG: return formats[precision][1];
+        case GL_RGB: return formats[precision][2];
+        case GL_RGBA: return formats[precision][3];
+        default: assert(0);
+    }
+    return 0;
+}
 
 static void initTile(TextureTile t)
 {
-    GLuint internalFormat;
-    switch (t.format) {
-        case GL_RED:
-            internalFormat = GL_R32F;
-            break;
-        case GL_RG:
-            internalFormat = GL_RG32F;
-            break;
-        case GL_RGB:
-            internalFormat = GL_RGB32F;
-            break;
-        case GL_RGBA:
-            internalFormat = GL_RGBA32F;
-            break;
-        default:
-            assert(0);
-    }
+    GLuint internalFormat = getInternalFormat(t.format, t.type);
 
     glBindTexture(GL_TEXTURE_2D, t.id);
     GLDEBUG();
-    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, t.w, t.h, 0, t.format, GL_FLOAT, NULL);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, t.w, t.h, 0, t.format, t.type, NULL);
     GLDEBUG();
 
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -90,128 +108,573 @@ static void initTile(TextureTile t)
     GLDEBUG();
 }
 
-static TextureTile takeTile(size_t w, size_t h, unsigned format)
+// unused tiles, kept from the least to the most recently given back
+// they are also grouped by size and format so that a matching tile is found at once,
+// the least recently used ones are deleted when all the tiles take more than gTextureLimitMB
+struct TileKey {
+    size_t w, h;
+    unsigned format, type;
+
+    bool operator==(const TileKey& o) const {
+        return w == o.w && h == o.h && format == o.format && type == o.type;
+    }
+};
+
+struct TileKeyHash {
+    size_t operator()(const TileKey& k) const {
+        return ((k.w * 31 + k.h) * 31 + k.format) * 31 + k.type;
+    }
+};
+
+static struct {
+    std::list<TextureTile> lru;
+    // the entries of a group are in the same order as in 'lru'
+    std::unordered_map<TileKey, std::deque<std::list<TextureTile>::iterator>, TileKeyHash> groups;
+    TexturePoolStats stats;
+} pool;
+
+static TileKey getTileKey(const TextureTile& t)
 {
-    for (auto it = tileCache.begin(); it != tileCache.end(); it++) {
-        TextureTile t = *it;
-        if (t.w == w && t.h == h && t.format == format) {
-            tileCache.erase(it);
-            return t;
+    return TileKey{t.w, t.h, t.format, t.type};
+}
+
+static size_t getTileBytes(const TextureTile& t)
+{
+    size_t channels = t.format == GL_RED ? 1 : t.format == GL_RG ? 2 : t.format == GL_RGB ? 3 : 4;
+    size_t samplesize = t.type == GL_UNSIGNED_BYTE ? 1 : t.type == GL_FLOAT ? 4 : 2;
+    size_t bytes = t.w * t.h * channels * samplesize;
+    // the mipmaps add a third
+    if (gDownsamplingQuality >= 2)
+        bytes += bytes / 3;
+    return bytes;
+}
+
+static void evictTiles(size_t need)
+{
+    size_t limit = gTextureLimitMB * 1000000;
+    while (pool.stats.bytesResident + need > limit && !pool.lru.empty()) {
+        TextureTile t = pool.lru.front();
+        auto group = pool.groups.find(getTileKey(t));
+        group->second.pop_front();
+        if (group->second.empty()) {
+            pool.groups.erase(group);
         }
-    }
+        pool.lru.pop_front();
 
-    TextureTile tile;
-    if (!tileCache.empty()) {
-        tile = tileCache.back();
-        tileCache.pop_back();
-    } else {
-        glGenTextures(1, &tile.id);
+        glDeleteTextures(1, &t.id);
         GLDEBUG();
+        pool.stats.bytesResident -= getTileBytes(t);
+        pool.stats.bytesUnused -= getTileBytes(t);
+        pool.stats.evictions++;
     }
+}
+
+static TextureTile takeTile(size_t w, size_t h, unsigned format, unsigned type)
+{
+    TextureTile tile;
     tile.w = w;
     tile.h = h;
     tile.format = format;
+    tile.type = type;
+
+    auto group = pool.groups.find(getTileKey(tile));
+    if (group != pool.groups.end()) {
+        auto it = group->second.back();
+        tile = *it;
+        group->second.pop_back();
+        if (group->second.empty()) {
+            pool.groups.erase(group);
+        }
+        pool.lru.erase(it);
+        pool.stats.bytesUnused -= getTileBytes(tile);
+        pool.stats.hits++;
+        return tile;
+    }
+
+    evictTiles(getTileBytes(tile));
+    glGenTextures(1, &tile.id);
+    GLDEBUG();
     initTile(tile);
+    pool.stats.bytesResident += getTileBytes(tile);
+    pool.stats.allocations++;
     return tile;
 }
 
 static void giveTile(TextureTile t)
 {
-    tileCache.push_back(t);
+    auto it = pool.lru.insert(pool.lru.end(), t);
+    pool.groups[getTileKey(t)].push_back(it);
+    pool.stats.bytesUnused += getTileBytes(t);
+    evictTiles(0);
 }
 
-void Texture::create(size_t w, size_t h, unsigned format)
+// the images are cut in tiles of this size, only the tiles in view are resident
+static const size_t TILESIZE = 512;
+// margin around the views (in texels) uploaded in advance for panning
+static const float MARGIN = 128;
+// number of frames a tile stays resident after leaving the views
+static const size_t UNUSED_FRAMES = 30;
+
+// incremented by processUploads()
+static size_t currentFrame = 0;
+
+// the textures in use, by image
+static std::unordered_map<const Image*, std::weak_ptr<Texture>> textures;
+
+// the samples are uploaded as they are, in tiles of the same precision
+static void getFormat(const Image& img, unsigned& format, unsigned& type, float& normalization)
 {
-    for (auto t : tiles) {
-        giveTile(t);
+    if (img.c == 1)
+        format = GL_RED;
+    else if (img.c == 2)
+        format = GL_RG;
+    else if (img.c == 3)
+        format = GL_RGB;
+    else if (img.c == 4)
+        format = GL_RGBA;
+    else
+        assert(0);
+
+    normalization = 1.f;
+    switch (img.type) {
+        case Image::U8:
+            type = GL_UNSIGNED_BYTE;
+            normalization = 255.f;
+            break;
+        case Image::U16:
+            type = GL_UNSIGNED_SHORT;
+            normalization = 65535.f;
+            break;
+        case Image::F16:
+            type = GL_HALF_FLOAT;
+            break;
+        case Image::F32:
+        default:
+            type = GL_FLOAT;
+            break;
     }
-    tiles.clear();
+}
 
-    static size_t ts = 0;
-    if (!ts) {
-        GLDEBUG();
-        int _ts;
-        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &_ts);
-        GLDEBUG();
-        ts = _ts;
-        ts = 1024;
-    }
-    for (size_t y = 0; y < h; y += ts) {
-        for (size_t x = 0; x < w; x += ts) {
-            size_t tw = std::min(ts, w - x);
-            size_t th = std::min(ts, h - y);
-            TextureTile t = takeTile(tw, th, format);
-            t.x = x;
-            t.y = y;
-            tiles.push_back(t);
-        }
+struct TextureUpload {
+    // null once the texture is destroyed, the copies are then skipped
+    Texture* texture;
+    std::shared_ptr<Image> image;
+    // number of frames since the start of the upload
+    int frames;
+    size_t remaining;
+};
+
+// copy of a tile of an image, through a pixel buffer object
+struct TileUpload {
+    std::shared_ptr<TextureUpload> upload;
+    size_t cell;
+    TextureTile tile;
+    ImRect intersect;
+    ImRect totile;
+    size_t bytes;
+    GLuint pbo;
+    void* mapped;
+};
+
+// the upload thread fills the mapped buffers while the main thread
+// issues the copies of the previous ones, only the main thread calls GL
+static struct {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<TileUpload> waiting;  // waiting for a buffer, main thread only
+    std::deque<TileUpload> tofill;
+    std::deque<TileUpload> filled;
+    std::vector<GLuint> buffers;  // unused buffers, main thread only
+    size_t inflight = 0;  // bytes of the mapped buffers, main thread only
+    std::vector<std::shared_ptr<TextureUpload>> uploads;  // main thread only
+    std::vector<GLuint> copied;  // tiles copied during this frame, main thread only
+    bool started = false;
+} streamer;
+
+// memory of the mapped buffers, a frame can upload at least that much
+static const size_t STREAMING_BYTES = 128 << 20;
+
+static void fillTile(const TileUpload& u, void* dest)
+{
+    const std::shared_ptr<Image>& img = u.upload->image;
+    size_t tw = u.intersect.GetWidth();
+    size_t th = u.intersect.GetHeight();
+    size_t rowsize = tw * img->c * img->getSampleSize();
+    for (size_t y = 0; y < th; y++) {
+        size_t offset = img->w * ((size_t)u.intersect.Min.y + y) + (size_t)u.intersect.Min.x;
+        img->copySamples(offset * img->c, tw * img->c, (uint8_t*) dest + y * rowsize);
     }
+}
 
-    this->size.x = w;
-    this->size.y = h;
-    this->format = format;
+static void runUploadThread()
+{
+    for (;;) {
+        TileUpload u;
+        {
+            std::unique_lock<std::mutex> _lock(streamer.lock);
+            streamer.cv.wait(_lock, [] { return !streamer.tofill.empty(); });
+            u = streamer.tofill.front();
+            streamer.tofill.pop_front();
+        }
+        fillTile(u, u.mapped);
+        std::lock_guard<std::mutex> _lock(streamer.lock);
+        streamer.filled.push_back(u);
+    }
 }
 
-void Texture::upload(const std::shared_ptr<Image>& img, ImRect area)
+static void copyTile(const TileUpload& u, const void* data)
 {
+    unsigned glformat = u.tile.format;
+    glBindTexture(GL_TEXTURE_2D, u.tile.id);
     GLDEBUG();
-    unsigned int glformat;
-    if (img->c == 1)
-        glformat = GL_RED;
-    else if (img->c == 2)
-        glformat = GL_RG;
-    else if (img->c == 3)
-        glformat = GL_RGB;
-    else if (img->c == 4)
-        glformat = GL_RGBA;
-    else
-        assert(0);
 
-    size_t w = img->w;
-    size_t h = img->h;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    GLDEBUG();
+    glTexSubImage2D(GL_TEXTURE_2D, 0, u.totile.Min.x, u.totile.Min.y,
+                    u.totile.GetWidth(), u.totile.GetHeight(), glformat, u.tile.type, data);
+    GLDEBUG();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GLDEBUG();
 
-    if (size.x != w || size.y != h || format != glformat) {
-        create(w, h, glformat);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    GLDEBUG();
+    streamer.copied.push_back(u.tile.id);
+}
+
+// the rows of a tile arrive in several copies while its image is decoded,
+// so its mipmaps are generated once per frame instead of after each copy
+static void generateMipmaps()
+{
+    auto& copied = streamer.copied;
+    if (gDownsamplingQuality >= 2) {
+        std::sort(copied.begin(), copied.end());
+        copied.erase(std::unique(copied.begin(), copied.end()), copied.end());
+        for (GLuint id : copied) {
+            glBindTexture(GL_TEXTURE_2D, id);
+            GLDEBUG();
+            glGenerateMipmap(GL_TEXTURE_2D);
+            GLDEBUG();
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        GLDEBUG();
     }
+    copied.clear();
+}
+
+static void completeUpload(const std::shared_ptr<TextureUpload>& upload)
+{
+    Texture* texture = upload->texture;
+    if (texture) {
+        texture->displayable = true;
+        if (texture->pending == upload) {
+            texture->pending = nullptr;
+        }
+    }
+    auto& uploads = streamer.uploads;
+    uploads.erase(std::remove(uploads.begin(), uploads.end(), upload), uploads.end());
+}
 
-    for (auto t : tiles) {
-        ImRect intersect(t.x, t.y, t.x+t.w, t.y+t.h);
-        intersect.ClipWithFull(area);
-        ImRect totile = intersect;
-        totile.Translate(ImVec2(-t.x, -t.y));
+// the tile of the texture that the upload fills, null if it left the view since
+static TextureTile* findTile(const TileUpload& u)
+{
+    Texture* texture = u.upload->texture;
+    if (!texture)
+        return nullptr;
+    auto it = texture->tiles.find(u.cell);
+    if (it == texture->tiles.end() || it->second.id != u.tile.id)
+        return nullptr;
+    return &it->second;
+}
 
-        if (intersect.GetWidth() == 0 || intersect.GetHeight() == 0) {
+static void finishTile(const TileUpload& u)
+{
+    TextureTile* tile = findTile(u);
+    if (tile) {
+        tile->ready = true;
+    }
+    if (--u.upload->remaining == 0) {
+        completeUpload(u.upload);
+    }
+}
+
+// the tiles out of the views for a while return to the pool
+static void releaseUnusedTiles()
+{
+    for (auto& entry : textures) {
+        std::shared_ptr<Texture> texture = entry.second.lock();
+        if (!texture)
             continue;
+        for (auto it = texture->tiles.begin(); it != texture->tiles.end();) {
+            if (it->second.lastUsed + UNUSED_FRAMES < currentFrame) {
+                giveTile(it->second);
+                it = texture->tiles.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+}
+
+std::shared_ptr<Texture> Texture::get(const std::shared_ptr<Image>& image, float scale, ImVec2 displaySize)
+{
+    std::shared_ptr<Texture> texture = textures[image.get()].lock();
+    // the address can be reused by a new image while a window still shows the old one
+    if (!texture || texture->image.lock() != image) {
+        texture = std::make_shared<Texture>();
+        texture->image = image;
+        texture->key = image.get();
+        texture->scale = scale;
+        texture->displaySize = displaySize;
+        texture->size = ImVec2(image->w, image->h);
+        getFormat(*image, texture->format, texture->type, texture->normalization);
+        textures[image.get()] = texture;
+    }
+    return texture;
+}
+
+void Texture::request(ImRect rect, ImVec2 focus)
+{
+    std::shared_ptr<Image> img = image.lock();
+    if (!img)
+        return;
+
+    rect = ImRect(rect.Min / scale, rect.Max / scale);
+    focus = focus / scale;
+    rect.Expand(MARGIN);
+    rect.Floor();
+    rect.ClipWithFull(ImRect(0, 0, img->w, img->h));
+    if (rect.GetWidth() <= 0 || rect.GetHeight() <= 0)
+        return;
+
+    // the tiles in view stay resident, the missing ones are uploaded
+    size_t gw = (img->w + TILESIZE - 1) / TILESIZE;
+    size_t gx0 = rect.Min.x / TILESIZE;
+    size_t gy0 = rect.Min.y / TILESIZE;
+    size_t gx1 = (rect.Max.x + TILESIZE - 1) / TILESIZE;
+    size_t gy1 = (rect.Max.y + TILESIZE - 1) / TILESIZE;
+    std::vector<size_t> missing;
+    for (size_t gy = gy0; gy < gy1; gy++) {
+        for (size_t gx = gx0; gx < gx1; gx++) {
+            auto it = tiles.find(gy * gw + gx);
+            if (it != tiles.end()) {
+                it->second.lastUsed = currentFrame;
+            } else {
+                missing.push_back(gy * gw + gx);
+            }
         }
+    }
 
-        const float* data = img->pixels + (w * (size_t)intersect.Min.y + (size_t)intersect.Min.x)*img->c;
+    // one upload at a time, another window may have requested it
+    if (isUploading())
+        return;
 
-        glBindTexture(GL_TEXTURE_2D, t.id);
-        GLDEBUG();
+    // the rows decoded since the last upload are copied to the resident tiles,
+    // the acquire pairs with the release of the decoder so that the rows below are written
+    size_t from = validRows;
+    validRows = img->validRows.load(std::memory_order_acquire);
+    std::vector<size_t> cells = missing;
+    for (auto& it : tiles) {
+        const TextureTile& t = it.second;
+        if ((size_t) t.y < validRows && t.y + t.h > from) {
+            cells.push_back(it.first);
+        }
+    }
+    if (cells.empty())
+        return;
+    upload(img, cells, focus, from, validRows);
+}
 
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, w);
+TexturePoolStats Texture::getPoolStats()
+{
+    return pool.stats;
+}
+
+void Texture::processUploads()
+{
+    auto start = std::chrono::steady_clock::now();
+    auto overBudget = [&]() {
+        std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() > gUploadBudget;
+    };
+
+    std::deque<TileUpload> filled;
+    {
+        std::lock_guard<std::mutex> _lock(streamer.lock);
+        filled.swap(streamer.filled);
+    }
+
+    // the copies from the buffers are asynchronous
+    bool active = !filled.empty();
+    while (!filled.empty() && !overBudget()) {
+        TileUpload u = filled.front();
+        filled.pop_front();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, u.pbo);
         GLDEBUG();
-        glTexSubImage2D(GL_TEXTURE_2D, 0, totile.Min.x, totile.Min.y,
-                        totile.GetWidth(), totile.GetHeight(), glformat, GL_FLOAT, data);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
         GLDEBUG();
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        if (findTile(u)) {
+            copyTile(u, 0);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
         GLDEBUG();
+        streamer.buffers.push_back(u.pbo);
+        streamer.inflight -= u.bytes;
+        finishTile(u);
+    }
+    if (!filled.empty()) {
+        // for the next frame
+        std::lock_guard<std::mutex> _lock(streamer.lock);
+        streamer.filled.insert(streamer.filled.begin(), filled.begin(), filled.end());
+    }
 
-        if (gDownsamplingQuality >= 2) {
-            glGenerateMipmap(GL_TEXTURE_2D);
+    std::vector<TileUpload> tofill;
+    while (!streamer.waiting.empty() && !overBudget()) {
+        TileUpload& u = streamer.waiting.front();
+        if (!findTile(u)) {
+            finishTile(u);
+            streamer.waiting.pop_front();
+            continue;
+        }
+        if (streamer.inflight && streamer.inflight + u.bytes > STREAMING_BYTES)
+            break;
+
+        if (streamer.buffers.empty()) {
+            GLuint pbo;
+            glGenBuffers(1, &pbo);
             GLDEBUG();
+            streamer.buffers.push_back(pbo);
         }
+        u.pbo = streamer.buffers.back();
+        streamer.buffers.pop_back();
 
-        glBindTexture(GL_TEXTURE_2D, 0);
+        // orphan the previous storage of the buffer so that mapping does not wait for the GPU
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, u.pbo);
+        GLDEBUG();
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, u.bytes, NULL, GL_STREAM_DRAW);
+        GLDEBUG();
+        u.mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
         GLDEBUG();
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        GLDEBUG();
+
+        if (u.mapped) {
+            streamer.inflight += u.bytes;
+            tofill.push_back(u);
+        } else {
+            // synchronous upload
+            streamer.buffers.push_back(u.pbo);
+            std::vector<uint8_t> data(u.bytes);
+            fillTile(u, data.data());
+            copyTile(u, data.data());
+            finishTile(u);
+        }
+        streamer.waiting.pop_front();
+    }
+    generateMipmaps();
+
+    if (!tofill.empty()) {
+        if (!streamer.started) {
+            std::thread(runUploadThread).detach();
+            streamer.started = true;
+        }
+        {
+            std::lock_guard<std::mutex> _lock(streamer.lock);
+            streamer.tofill.insert(streamer.tofill.end(), tofill.begin(), tofill.end());
+        }
+        streamer.cv.notify_one();
+    }
+
+    // a new image that takes more than a couple of frames is displayed progressively,
+    // the tiles that are not filled yet show the background
+    for (auto& upload : streamer.uploads) {
+        upload->frames++;
+        if (upload->texture && upload->frames > 2) {
+            upload->texture->displayable = true;
+        }
+    }
+
+    currentFrame++;
+    releaseUnusedTiles();
+
+    // keep drawing frames until the new tiles are displayed
+    if (active || !streamer.uploads.empty()) {
+        gActive = std::max(gActive, 2);
     }
 }
 
+void Texture::upload(const std::shared_ptr<Image>& img, const std::vector<size_t>& cells, ImVec2 focus,
+                     size_t fromRow, size_t toRow)
+{
+    auto upload = std::make_shared<TextureUpload>();
+    upload->texture = this;
+    upload->image = img;
+    upload->frames = 0;
+
+    size_t gw = (img->w + TILESIZE - 1) / TILESIZE;
+    std::vector<TileUpload> uploads;
+    for (size_t cell : cells) {
+        size_t x = (cell % gw) * TILESIZE;
+        size_t y = (cell / gw) * TILESIZE;
+        size_t tw = std::min(TILESIZE, img->w - x);
+        size_t th = std::min(TILESIZE, img->h - y);
+        // the rows from 'toRow' may still be written by the decoder, they are copied by a later request
+        size_t y1 = std::min(y + th, toRow);
+        // a resident tile keeps its rows above 'fromRow' and stays drawn
+        size_t y0 = y;
+        auto it = tiles.find(cell);
+        if (it != tiles.end())
+            y0 = std::max(y, fromRow);
+        if (y0 >= y1)
+            continue;
+        if (it == tiles.end()) {
+            TextureTile t = takeTile(tw, th, format, type);
+            t.x = x;
+            t.y = y;
+            t.ready = false;
+            t.lastUsed = currentFrame;
+            it = tiles.emplace(cell, t).first;
+        }
+
+        TileUpload u;
+        u.upload = upload;
+        u.cell = cell;
+        u.tile = it->second;
+        u.intersect = ImRect(x, y0, x + tw, y1);
+        u.totile = ImRect(0, y0 - y, tw, y1 - y);
+        u.bytes = tw * (y1 - y0) * img->c * img->getSampleSize();
+        u.pbo = 0;
+        u.mapped = nullptr;
+        uploads.push_back(u);
+    }
+    if (uploads.empty())
+        return;
+
+    // center of the view first
+    auto distance = [&focus](const TileUpload& u) {
+        ImVec2 d = u.intersect.GetCenter() - focus;
+        return d.x * d.x + d.y * d.y;
+    };
+    std::stable_sort(uploads.begin(), uploads.end(), [&](const TileUpload& a, const TileUpload& b) {
+        return distance(a) < distance(b);
+    });
+
+    upload->remaining = uploads.size();
+    streamer.waiting.insert(streamer.waiting.end(), uploads.begin(), uploads.end());
+    streamer.uploads.push_back(upload);
+    pending = upload;
+}
+
 Texture::~Texture()
 {
-    for (auto t : tiles) {
-        giveTile(t);
+    for (auto& t : tiles) {
+        giveTile(t.second);
     }
     tiles.clear();
+    if (pending) {
+        pending->texture = nullptr;
+    }
+    auto it = textures.find(key);
+    if (it != textures.end() && it->second.expired()) {
+        textures.erase(it);
+    }
 }
-
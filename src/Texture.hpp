@@ -2,29 +2,86 @@
 
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 #include "imgui.h"
 #define IMGUI_DEFINE_MATH_OPERATORS
 #include "imgui_internal.h"
 
 struct Image;
+struct TextureUpload;
 
 struct TextureTile {
     unsigned id;
     int x, y;
     size_t w, h;
     unsigned format;
+    // GL type of the samples, the internal format has the same precision
+    unsigned type;
+    // false until the first copy to the tile, the tile is not drawn meanwhile
+    bool ready;
+    // last frame where the tile was in the view of a window
+    size_t lastUsed;
 };
 
+// counters of the pool of tiles shared by the textures
+struct TexturePoolStats {
+    // tiles taken from the pool, and tiles allocated because none matched
+    size_t hits = 0;
+    size_t allocations = 0;
+    // unused tiles deleted to stay under TEXTURE_LIMIT
+    size_t evictions = 0;
+    size_t bytesResident = 0;
+    size_t bytesUnused = 0;
+};
+
+// tiles of an image on the GPU, shared by all the windows that display the image
+// only the tiles in the views of the windows are resident
 struct Texture {
-    std::vector<TextureTile> tiles;
+    // by position in the grid of tiles of the image (y * width + x)
+    std::unordered_map<size_t, TextureTile> tiles;
     ImVec2 size;
     unsigned format = -1;
+    unsigned type = -1;
+    // integer samples are normalized by GL, a texel times this factor gives the sample
+    float normalization = 1.f;
+    std::weak_ptr<Image> image;
+    const Image* key = nullptr;
+    // size of a texel in pixels of the displayed image, larger than 1 for a reduced level
+    float scale = 1.f;
+    // size of the displayed image
+    ImVec2 displaySize;
+    // set once the first upload is done or after a couple of frames, see processUploads()
+    bool displayable = false;
+    // upload in progress, its tiles are already in 'tiles' but not ready
+    std::shared_ptr<TextureUpload> pending;
+    // rows of a partially decoded image that were valid at the last upload, only these are uploaded and drawn
+    size_t validRows = 0;
 
     ~Texture();
 
-    void create(size_t w, size_t h, unsigned format);
-    void upload(const std::shared_ptr<Image>& img, ImRect area);
+    // texture of the image, created if no window displays the image yet
+    // 'image' can be a level of an ImagePyramid, displayed in place of an image of size 'displaySize'
+    static std::shared_ptr<Texture> get(const std::shared_ptr<Image>& image, float scale, ImVec2 displaySize);
+
+    // makes sure that 'rect' (in coordinates of the displayed image) is uploaded
+    void request(ImRect rect, ImVec2 focus);
+    // allocates the tiles of the cells and copies the pixels asynchronously, see processUploads()
+    // the tiles closest to 'focus' are copied first
+    // for the cells that are already resident, only the rows from 'fromRow' are copied
+    // the rows from 'toRow' are not copied, the decoder of a partial image may still be writing them
+    void upload(const std::shared_ptr<Image>& img, const std::vector<size_t>& cells, ImVec2 focus,
+                size_t fromRow, size_t toRow);
+    bool isUploading() const { return pending != nullptr; }
+    // true if the tiles of the pending upload are displayed while they are filled
+    bool isProgressive() const { return pending && displayable; }
+    bool isDisplayable() const { return displayable; }
     ImVec2 getSize() { return size; }
+
+    // issues the copies of the buffers filled by the upload thread and maps new buffers
+    // called once per frame by the main thread
+    static void processUploads();
+
+    static TexturePoolStats getPoolStats();
 };
 
@@ -459,12 +459,23 @@ void Window::displaySequence(Sequence& seq)
     ImRect clip = getClipRect();
     ImVec2 winSize = clip.Max - clip.Min;
 
+    // the provider decodes the visible part of the image first
+    if (seq.imageprovider && !seq.imageprovider->isLoaded() && view) {
+        RegionOfInterest roi;
+        roi.cx = view->center.x;
+        roi.cy = view->center.y;
+        roi.hw = winSize.x / (2.f * view->zoom * factor);
+        roi.hh = winSize.y / (2.f * view->zoom * factor);
+        seq.imageprovider->setRegionOfInterest(roi);
+    }
+
     ImVec2 delta = ImGui::GetIO().MouseDelta;
     bool dragging = ImGui::IsMouseDown(0) && (delta.x || delta.y);
     if (seq.colormap && seq.view && seq.player) {
         if (gShowImage && seq.colormap->shader) {
             ImGui::PushClipRect(clip.Min, clip.Max, true);
-            displayarea.draw(seq.getCurrentImage(), clip.Min, winSize, seq.colormap, seq.view, factor);
+            displayarea.draw(seq.getCurrentImage(), clip.Min, winSize, seq.colormap, seq.view, factor,
+                             seq.preview, seq.previewSize);
             ImGui::PopClipRect();
         }
 
@@ -878,6 +889,13 @@ void Window::displayInfo(Sequence& seq)
         } //else { ImGui::Text(""); }
     }
 
+    {
+        TexturePoolStats stats = Texture::getPoolStats();
+        ImGui::Text("Textures: %luMB (%luMB unused), %lu hits, %lu allocations",
+                    stats.bytesResident / 1000000, stats.bytesUnused / 1000000,
+                    stats.hits, stats.allocations);
+    }
+
     if (gShowHistogram) {
         std::array<float,3> cmin, cmax;
         seq.colormap->getRange(cmin, cmax);
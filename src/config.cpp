@@ -17,6 +17,8 @@
 #include "View.hpp"
 #include "Colormap.hpp"
 #include "Terminal.hpp"
+#include "Texture.hpp"
+#include "convert.hpp"
 #include "events.hpp"
 
 // generated by cmake
@@ -268,6 +270,14 @@ void config::load()
                              .addProperty("size", &Image::size)
                             );
 
+    (*state)["TexturePoolStats"].setClass(kaguya::UserdataMetatable<TexturePoolStats>()
+                             .addProperty("hits", &TexturePoolStats::hits)
+                             .addProperty("allocations", &TexturePoolStats::allocations)
+                             .addProperty("evictions", &TexturePoolStats::evictions)
+                             .addProperty("bytes_resident", &TexturePoolStats::bytesResident)
+                             .addProperty("bytes_unused", &TexturePoolStats::bytesUnused)
+                            );
+
     (*state)["ImageCollection"].setClass(kaguya::UserdataMetatable<ImageCollection>()
                              .addFunction("get_filename", &ImageCollection::getFilename)
                              .addFunction("get_length", &ImageCollection::getLength)
@@ -307,6 +317,8 @@ void config::load()
     (*state)["new_view"] = newView;
     (*state)["new_player"] = newPlayer;
     (*state)["new_colormap"] = newColormap;
+    (*state)["get_texture_pool_stats"] = Texture::getPoolStats;
+    (*state)["benchmark_conversions"] = convert::benchmark;
     (*state)["get_terminal_command"] = getTerminalCommand;
     (*state)["set_terminal_command"] = setTerminalCommand;
 
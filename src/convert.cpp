@@ -0,0 +1,569 @@
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CONVERT_X86
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define CONVERT_NEON
+#include <arm_neon.h>
+#endif
+
+#include "convert.hpp"
+
+namespace convert {
+
+typedef void (*Kernel)(const void* src, size_t n, float* dst);
+
+static float halfToFloat(uint16_t h)
+{
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        // inf or nan
+        bits = sign | 0x7f800000 | (mant << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // subnormal half, normal float
+        exp = 113;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(float));
+    return f;
+}
+
+template <typename T>
+static void scalarKernel(const void* src, size_t n, float* dst)
+{
+    const T* s = (const T*) src;
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = s[i];
+    }
+}
+
+static void scalarHalfKernel(const void* src, size_t n, float* dst)
+{
+    const uint16_t* s = (const uint16_t*) src;
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = halfToFloat(s[i]);
+    }
+}
+
+static void copyKernel(const void* src, size_t n, float* dst)
+{
+    memcpy(dst, src, n * sizeof(float));
+}
+
+#ifdef CONVERT_X86
+
+// the kernels convert the largest multiple of their vector size, the scalar kernels finish the tail
+#define SSE2 __attribute__((target("sse2")))
+
+SSE2 static void sse2U8(const void* src, size_t n, float* dst)
+{
+    const uint8_t* s = (const uint8_t*) src;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+        _mm_storeu_ps(dst + i + 8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+        _mm_storeu_ps(dst + i + 12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+    }
+    scalarKernel<uint8_t>(s + i, n - i, dst + i);
+}
+
+SSE2 static void sse2I8(const void* src, size_t n, float* dst)
+{
+    const int8_t* s = (const int8_t*) src;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        // sign extension by duplicating the sample in the high half and shifting it back
+        __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+        __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16)));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16)));
+        _mm_storeu_ps(dst + i + 8, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16)));
+        _mm_storeu_ps(dst + i + 12, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)));
+    }
+    scalarKernel<int8_t>(s + i, n - i, dst + i);
+}
+
+SSE2 static void sse2U16(const void* src, size_t n, float* dst)
+{
+    const uint16_t* s = (const uint16_t*) src;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+    }
+    scalarKernel<uint16_t>(s + i, n - i, dst + i);
+}
+
+SSE2 static void sse2I16(const void* src, size_t n, float* dst)
+{
+    const int16_t* s = (const int16_t*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)));
+        _mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16)));
+    }
+    scalarKernel<int16_t>(s + i, n - i, dst + i);
+}
+
+// there is no unsigned conversion before AVX-512, the high and low halves are converted separately
+// the high half times 65536 is exact, so the sum is rounded once like the scalar conversion
+SSE2 static void sse2U32(const void* src, size_t n, float* dst)
+{
+    const uint32_t* s = (const uint32_t*) src;
+    const __m128i mask = _mm_set1_epi32(0xffff);
+    const __m128 scale = _mm_set1_ps(65536.f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128 hi = _mm_cvtepi32_ps(_mm_srli_epi32(v, 16));
+        __m128 lo = _mm_cvtepi32_ps(_mm_and_si128(v, mask));
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(hi, scale), lo));
+    }
+    scalarKernel<uint32_t>(s + i, n - i, dst + i);
+}
+
+SSE2 static void sse2I32(const void* src, size_t n, float* dst)
+{
+    const int32_t* s = (const int32_t*) src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm_storeu_ps(dst + i, _mm_cvtepi32_ps(v));
+    }
+    scalarKernel<int32_t>(s + i, n - i, dst + i);
+}
+
+SSE2 static void sse2F64(const void* src, size_t n, float* dst)
+{
+    const double* s = (const double*) src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(s + i));
+        __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(s + i + 2));
+        _mm_storeu_ps(dst + i, _mm_movelh_ps(lo, hi));
+    }
+    scalarKernel<double>(s + i, n - i, dst + i);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void avx2U8(const void* src, size_t n, float* dst)
+{
+    const uint8_t* s = (const uint8_t*) src;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)));
+        _mm256_storeu_ps(dst + i + 8, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v, 8))));
+    }
+    scalarKernel<uint8_t>(s + i, n - i, dst + i);
+}
+
+AVX2 static void avx2I8(const void* src, size_t n, float* dst)
+{
+    const int8_t* s = (const int8_t*) src;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(v)));
+        _mm256_storeu_ps(dst + i + 8, _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(v, 8))));
+    }
+    scalarKernel<int8_t>(s + i, n - i, dst + i);
+}
+
+AVX2 static void avx2U16(const void* src, size_t n, float* dst)
+{
+    const uint16_t* s = (const uint16_t*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v)));
+    }
+    scalarKernel<uint16_t>(s + i, n - i, dst + i);
+}
+
+AVX2 static void avx2I16(const void* src, size_t n, float* dst)
+{
+    const int16_t* s = (const int16_t*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)));
+    }
+    scalarKernel<int16_t>(s + i, n - i, dst + i);
+}
+
+AVX2 static void avx2U32(const void* src, size_t n, float* dst)
+{
+    const uint32_t* s = (const uint32_t*) src;
+    const __m256i mask = _mm256_set1_epi32(0xffff);
+    const __m256 scale = _mm256_set1_ps(65536.f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(v, 16));
+        __m256 lo = _mm256_cvtepi32_ps(_mm256_and_si256(v, mask));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_mul_ps(hi, scale), lo));
+    }
+    scalarKernel<uint32_t>(s + i, n - i, dst + i);
+}
+
+AVX2 static void avx2I32(const void* src, size_t n, float* dst)
+{
+    const int32_t* s = (const int32_t*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtepi32_ps(v));
+    }
+    scalarKernel<int32_t>(s + i, n - i, dst + i);
+}
+
+AVX2 static void avx2F64(const void* src, size_t n, float* dst)
+{
+    const double* s = (const double*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_ps(dst + i, _mm256_cvtpd_ps(_mm256_loadu_pd(s + i)));
+        _mm_storeu_ps(dst + i + 4, _mm256_cvtpd_ps(_mm256_loadu_pd(s + i + 4)));
+    }
+    scalarKernel<double>(s + i, n - i, dst + i);
+}
+
+__attribute__((target("avx,f16c"))) static void f16cF16(const void* src, size_t n, float* dst)
+{
+    const uint16_t* s = (const uint16_t*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(v));
+    }
+    scalarHalfKernel(s + i, n - i, dst + i);
+}
+
+#endif
+
+#ifdef CONVERT_NEON
+
+static void neonU8(const void* src, size_t n, float* dst)
+{
+    const uint8_t* s = (const uint8_t*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v = vmovl_u8(vld1_u8(s + i));
+        vst1q_f32(dst + i, vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))));
+        vst1q_f32(dst + i + 4, vcvtq_f32_u32(vmovl_high_u16(v)));
+    }
+    scalarKernel<uint8_t>(s + i, n - i, dst + i);
+}
+
+static void neonI8(const void* src, size_t n, float* dst)
+{
+    const int8_t* s = (const int8_t*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t v = vmovl_s8(vld1_s8(s + i));
+        vst1q_f32(dst + i, vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))));
+        vst1q_f32(dst + i + 4, vcvtq_f32_s32(vmovl_high_s16(v)));
+    }
+    scalarKernel<int8_t>(s + i, n - i, dst + i);
+}
+
+static void neonU16(const void* src, size_t n, float* dst)
+{
+    const uint16_t* s = (const uint16_t*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v = vld1q_u16(s + i);
+        vst1q_f32(dst + i, vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))));
+        vst1q_f32(dst + i + 4, vcvtq_f32_u32(vmovl_high_u16(v)));
+    }
+    scalarKernel<uint16_t>(s + i, n - i, dst + i);
+}
+
+static void neonI16(const void* src, size_t n, float* dst)
+{
+    const int16_t* s = (const int16_t*) src;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        int16x8_t v = vld1q_s16(s + i);
+        vst1q_f32(dst + i, vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))));
+        vst1q_f32(dst + i + 4, vcvtq_f32_s32(vmovl_high_s16(v)));
+    }
+    scalarKernel<int16_t>(s + i, n - i, dst + i);
+}
+
+static void neonU32(const void* src, size_t n, float* dst)
+{
+    const uint32_t* s = (const uint32_t*) src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i, vcvtq_f32_u32(vld1q_u32(s + i)));
+    }
+    scalarKernel<uint32_t>(s + i, n - i, dst + i);
+}
+
+static void neonI32(const void* src, size_t n, float* dst)
+{
+    const int32_t* s = (const int32_t*) src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i, vcvtq_f32_s32(vld1q_s32(s + i)));
+    }
+    scalarKernel<int32_t>(s + i, n - i, dst + i);
+}
+
+static void neonF16(const void* src, size_t n, float* dst)
+{
+    const uint16_t* s = (const uint16_t*) src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(s + i))));
+    }
+    scalarHalfKernel(s + i, n - i, dst + i);
+}
+
+static void neonF64(const void* src, size_t n, float* dst)
+{
+    const double* s = (const double*) src;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x2_t lo = vcvt_f32_f64(vld1q_f64(s + i));
+        float32x2_t hi = vcvt_f32_f64(vld1q_f64(s + i + 2));
+        vst1q_f32(dst + i, vcombine_f32(lo, hi));
+    }
+    scalarKernel<double>(s + i, n - i, dst + i);
+}
+
+#endif
+
+static const int NFORMATS = F64 + 1;
+
+struct Kernels {
+    Kernel kernels[NFORMATS];
+    const char* names[NFORMATS];
+
+    void set(Format format, Kernel kernel, const char* name) {
+        kernels[format] = kernel;
+        names[format] = name;
+    }
+};
+
+static Kernels selectKernels()
+{
+    Kernels k;
+    k.set(U8, scalarKernel<uint8_t>, "scalar");
+    k.set(I8, scalarKernel<int8_t>, "scalar");
+    k.set(U16, scalarKernel<uint16_t>, "scalar");
+    k.set(I16, scalarKernel<int16_t>, "scalar");
+    k.set(U32, scalarKernel<uint32_t>, "scalar");
+    k.set(I32, scalarKernel<int32_t>, "scalar");
+    k.set(F16, scalarHalfKernel, "scalar");
+    k.set(F32, copyKernel, "memcpy");
+    k.set(F64, scalarKernel<double>, "scalar");
+
+#ifdef CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        k.set(U8, sse2U8, "sse2");
+        k.set(I8, sse2I8, "sse2");
+        k.set(U16, sse2U16, "sse2");
+        k.set(I16, sse2I16, "sse2");
+        k.set(U32, sse2U32, "sse2");
+        k.set(I32, sse2I32, "sse2");
+        k.set(F64, sse2F64, "sse2");
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        k.set(U8, avx2U8, "avx2");
+        k.set(I8, avx2I8, "avx2");
+        k.set(U16, avx2U16, "avx2");
+        k.set(I16, avx2I16, "avx2");
+        k.set(U32, avx2U32, "avx2");
+        k.set(I32, avx2I32, "avx2");
+        k.set(F64, avx2F64, "avx2");
+    }
+    if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c")) {
+        k.set(F16, f16cF16, "f16c");
+    }
+#endif
+
+#ifdef CONVERT_NEON
+    k.set(U8, neonU8, "neon");
+    k.set(I8, neonI8, "neon");
+    k.set(U16, neonU16, "neon");
+    k.set(I16, neonI16, "neon");
+    k.set(U32, neonU32, "neon");
+    k.set(I32, neonI32, "neon");
+    k.set(F16, neonF16, "neon");
+    k.set(F64, neonF64, "neon");
+#endif
+    return k;
+}
+
+static const Kernels& getKernels()
+{
+    static const Kernels kernels = selectKernels();
+    return kernels;
+}
+
+size_t getSampleSize(Format format)
+{
+    switch (format) {
+        case U8: case I8: return 1;
+        case U16: case I16: case F16: return 2;
+        case U32: case I32: case F32: return 4;
+        case F64: return 8;
+    }
+    return 0;
+}
+
+const char* getFormatName(Format format)
+{
+    static const char* names[NFORMATS] = {
+        "u8", "i8", "u16", "i16", "u32", "i32", "f16", "f32", "f64",
+    };
+    return names[format];
+}
+
+const char* getKernelName(Format format)
+{
+    return getKernels().names[format];
+}
+
+void toFloat(Format format, const void* src, size_t n, float* dst)
+{
+    getKernels().kernels[format](src, n, dst);
+}
+
+// the strided variants go through a buffer that stays in the L1 cache,
+// so that the contiguous kernel does the conversion
+static const size_t BLOCK = 1024;
+
+template <typename T>
+static void gather(const void* src, size_t stride, size_t n, void* dst)
+{
+    const T* s = (const T*) src;
+    T* d = (T*) dst;
+    for (size_t i = 0; i < n; i++) {
+        d[i] = s[i * stride];
+    }
+}
+
+void toFloatStrided(Format format, const void* src, size_t stride, size_t n, float* dst)
+{
+    if (stride == 1) {
+        toFloat(format, src, n, dst);
+        return;
+    }
+
+    size_t size = getSampleSize(format);
+    uint64_t buffer[BLOCK];
+    const uint8_t* s = (const uint8_t*) src;
+    for (size_t i = 0; i < n; i += BLOCK) {
+        size_t m = std::min(BLOCK, n - i);
+        const uint8_t* from = s + i * stride * size;
+        switch (size) {
+            case 1: gather<uint8_t>(from, stride, m, buffer); break;
+            case 2: gather<uint16_t>(from, stride, m, buffer); break;
+            case 4: gather<uint32_t>(from, stride, m, buffer); break;
+            case 8: gather<uint64_t>(from, stride, m, buffer); break;
+        }
+        toFloat(format, buffer, m, dst + i);
+    }
+}
+
+void toFloatInterleaved(Format format, const void* src, size_t n, float* dst, size_t stride)
+{
+    if (stride == 1) {
+        toFloat(format, src, n, dst);
+        return;
+    }
+
+    size_t size = getSampleSize(format);
+    float buffer[BLOCK];
+    const uint8_t* s = (const uint8_t*) src;
+    for (size_t i = 0; i < n; i += BLOCK) {
+        size_t m = std::min(BLOCK, n - i);
+        toFloat(format, s + i * size, m, buffer);
+        float* to = dst + i * stride;
+        for (size_t j = 0; j < m; j++) {
+            to[j * stride] = buffer[j];
+        }
+    }
+}
+
+// samples per nanosecond of 'f' on 'n' samples, best of a few runs
+template <typename F>
+static double measure(size_t n, F f)
+{
+    double best = 0.;
+    for (int run = 0; run < 5; run++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max(best, n / std::max(elapsed.count(), 1.));
+    }
+    return best;
+}
+
+std::string benchmark()
+{
+    // a few MB, larger than the caches like the rows of a decoded image
+    const size_t n = 1 << 20;
+    const size_t stride = 3;
+    std::vector<uint8_t> src(n * stride * sizeof(double));
+    for (size_t i = 0; i < src.size(); i++) {
+        // small exponents so that the halves and the doubles stay normal numbers
+        src[i] = (i * 37) & 0x3f;
+    }
+    std::vector<float> dst(n * stride);
+
+    std::ostringstream out;
+    out.precision(3);
+    for (int f = 0; f < NFORMATS; f++) {
+        Format format = (Format) f;
+        double contiguous = measure(n, [&]() {
+            toFloat(format, src.data(), n, dst.data());
+        });
+        double strided = measure(n, [&]() {
+            toFloatStrided(format, src.data(), stride, n, dst.data());
+        });
+        double interleaved = measure(n, [&]() {
+            toFloatInterleaved(format, src.data(), n, dst.data(), stride);
+        });
+        out << getFormatName(format) << " (" << getKernelName(format) << "): "
+            << contiguous << " samples/ns, strided " << strided
+            << ", interleaved " << interleaved << "\n";
+    }
+    return out.str();
+}
+
+}
+
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// conversions of decoded samples to float, shared by the decoders and the editors
+// the kernels use AVX2, SSE2 or NEON when available, on x86 they are chosen at runtime
+namespace convert {
+
+enum Format {
+    U8, I8, U16, I16, U32, I32, F16, F32, F64,
+};
+
+size_t getSampleSize(Format format);
+
+// converts the 'n' contiguous samples of 'src'
+void toFloat(Format format, const void* src, size_t n, float* dst);
+
+// converts 'n' samples taken every 'stride' samples of 'src', eg. a channel of interleaved pixels
+void toFloatStrided(Format format, const void* src, size_t stride, size_t n, float* dst);
+
+// converts 'n' contiguous samples into every 'stride' float of 'dst', eg. a plane into interleaved pixels
+void toFloatInterleaved(Format format, const void* src, size_t n, float* dst, size_t stride);
+
+const char* getFormatName(Format format);
+
+// instruction set of the kernel selected for the format on this CPU
+const char* getKernelName(Format format);
+
+// throughput of the selected kernels and of the strided variants, one line per format
+std::string benchmark();
+
+}
+
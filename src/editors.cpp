@@ -1,6 +1,9 @@
 #include <iostream>
+#include <mutex>
+#include <vector>
 
 #include "Image.hpp"
+#include "convert.hpp"
 
 #include "plambda.h"
 #ifdef USE_GMIC
@@ -22,13 +25,15 @@ static std::shared_ptr<Image> edit_images_plambda(const char* prog,
                               std::string& error)
 {
     size_t n = images.size();
+    std::vector<std::shared_ptr<const float>> samples(n);
     float* x[n];
     int w[n];
     int h[n];
     int d[n];
     for (size_t i = 0; i < n; i++) {
         std::shared_ptr<Image> img = images[i];
-        x[i] = img->pixels;
+        samples[i] = img->getFloatPixels();
+        x[i] = (float*) samples[i].get();
         w[i] = img->w;
         h[i] = img->h;
         d[i] = img->c;
@@ -58,13 +63,11 @@ static std::shared_ptr<Image> edit_images_gmic(const char* prog,
         std::shared_ptr<Image> img = images[i];
         gmic_image<float>& gimg = gimages[i];
         gimg.assign(img->w, img->h, 1, img->c);
-        const float* xptr = img->pixels;
-        for (size_t y = 0; y < img->h; y++) {
-            for (size_t x = 0; x < img->w; x++) {
-                for (size_t z = 0; z < img->c; z++) {
-                    gimg(x, y, 0, z) = *(xptr++);
-                }
-            }
+        std::shared_ptr<const float> samples = img->getFloatPixels();
+        // gmic stores the channels as planes
+        for (size_t z = 0; z < img->c; z++) {
+            convert::toFloatStrided(convert::F32, samples.get() + z, img->c, img->w * img->h,
+                                    gimg.data(0, 0, 0, z));
         }
     }
 
@@ -79,13 +82,9 @@ static std::shared_ptr<Image> edit_images_gmic(const char* prog,
     gmic_image<float>& image = gimages[0];
     size_t size = image._width * image._height * image._spectrum;
     float* data = (float*) malloc(sizeof(float) * size);
-    float* ptrdata = data;
-    for (size_t y = 0; y < image._height; y++) {
-        for (size_t x = 0; x < image._width; x++) {
-            for (size_t z = 0; z < image._spectrum; z++) {
-                *(ptrdata++) = image(x, y, 0, z);
-            }
-        }
+    for (size_t z = 0; z < image._spectrum; z++) {
+        convert::toFloatInterleaved(convert::F32, image.data(0, 0, 0, z), image._width * image._height,
+                                    data + z, image._spectrum);
     }
 
     std::shared_ptr<Image> img = std::make_shared<Image>(data, image._width,
@@ -103,6 +102,9 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
                              std::string& error)
 {
 #ifdef USE_OCTAVE
+    // the interpreter is shared by the loading threads
+    static std::mutex lock;
+    std::lock_guard<std::mutex> _lock(lock);
     static octave::interpreter* app;
 
     if (!app) {
@@ -128,7 +130,8 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
             dim_vector size((int)img->h, (int)img->w, (int)img->c);
             NDArray m(size);
 
-            float* xptr = img->pixels;
+            std::shared_ptr<const float> samples = img->getFloatPixels();
+            const float* xptr = samples.get();
             for (size_t y = 0; y < img->h; y++) {
                 for (size_t x = 0; x < img->w; x++) {
                     for (size_t z = 0; z < img->c; z++) {
@@ -150,12 +153,12 @@ static std::shared_ptr<Image> edit_images_octave(const char* prog,
             size_t d = m.ndims() == 3 ? m.pages() : 1;
             size_t size = w * h * d;
             float* data = (float*) malloc(sizeof(float) * size);
-            float* ptrdata = data;
-            for (size_t y = 0; y < h; y++) {
+            // the columns of the matrix are contiguous, they become columns of the image
+            const double* columns = m.data();
+            for (size_t z = 0; z < d; z++) {
                 for (size_t x = 0; x < w; x++) {
-                    for (size_t z = 0; z < d; z++) {
-                        *(ptrdata++) = m(y, x, z);
-                    }
+                    convert::toFloatInterleaved(convert::F64, columns + (z * w + x) * h, h,
+                                                data + x * d + z, w * d);
                 }
             }
             std::shared_ptr<Image> img = std::make_shared<Image>(data, w, h, d);
@@ -206,7 +209,7 @@ std::shared_ptr<Image> edit_images(EditType edittype, const std::string& _prog,
 #include "Sequence.hpp"
 #include "globals.hpp"
 
-ImageCollection* create_edited_collection(EditType edittype, const std::string& _prog)
+std::shared_ptr<ImageCollection> create_edited_collection(EditType edittype, const std::string& _prog)
 {
     char* prog = (char*) _prog.c_str();
     std::vector<Sequence*> sequences;
@@ -226,10 +229,10 @@ ImageCollection* create_edited_collection(EditType edittype, const std::string&
         return nullptr;
     }
 
-    std::vector<ImageCollection*> collections;
+    std::vector<std::shared_ptr<ImageCollection>> collections;
     for (auto s : sequences) {
         collections.push_back(s->uneditedCollection);
     }
-    return new EditedImageCollection(edittype, std::string(prog), collections);
+    return std::make_shared<EditedImageCollection>(edittype, std::string(prog), collections);
 }
 
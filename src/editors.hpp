@@ -16,5 +16,6 @@ std::shared_ptr<Image> edit_images(EditType edittype, const std::string& prog,
                                    const std::vector<std::shared_ptr<Image>>& images,
                                    std::string& error);
 
-class ImageCollection* create_edited_collection(EditType edittype, const std::string& prog);
+class ImageCollection;
+std::shared_ptr<ImageCollection> create_edited_collection(EditType edittype, const std::string& prog);
 
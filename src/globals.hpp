@@ -41,9 +41,12 @@ extern bool gShowMiniview;
 extern ImVec2 gDefaultSvgOffset;
 extern float gDefaultFramerate;
 extern int gDownsamplingQuality;
+extern float gUploadBudget;
+extern size_t gTextureLimitMB;
 extern size_t gCacheLimitMB;
 extern bool gPreload;
 extern bool gSmoothHistogram;
+extern bool gPreciseHistogram;
 extern bool gForceIioOpen;
 
 extern int gActive;
@@ -48,9 +48,13 @@
 #include "events.hpp"
 #include "LoadingThread.hpp"
 #include "ImageCache.hpp"
+#include "EvictionPolicy.hpp"
 #include "ImageProvider.hpp"
 #include "ImageCollection.hpp"
 #include "Histogram.hpp"
+#include "Texture.hpp"
+#include "HistogramIndex.hpp"
+#include "ImagePyramid.hpp"
 #include "Terminal.hpp"
 #include "EditGUI.hpp"
 #include "menu.hpp"
@@ -80,9 +84,12 @@ bool gShowImage;
 ImVec2 gDefaultSvgOffset;
 float gDefaultFramerate;
 int gDownsamplingQuality;
+float gUploadBudget;
+size_t gTextureLimitMB;
 size_t gCacheLimitMB;
 bool gPreload;
 bool gSmoothHistogram;
+bool gPreciseHistogram;
 bool gForceIioOpen;
 static bool showHelp = false;
 int gActive;
@@ -261,6 +268,100 @@ void parseArgs(int argc, char** argv)
     }
 }
 
+static std::vector<SleepyLoadingThreadPool::Request> getLoadingRequests(int upcoming)
+{
+    typedef SleepyLoadingThreadPool::Request Request;
+    std::vector<Request> requests;
+
+    // images to be displayed
+    for (auto seq : gSequences) {
+        std::shared_ptr<ImageProvider> provider = seq->imageprovider;
+        if (provider && !provider->isLoaded() && seq->collection) {
+            std::string key = seq->collection->getKey(seq->loadedFrame - 1);
+            requests.push_back(Request{key, SleepyLoadingThreadPool::VISIBLE,
+                                       [provider]() { return provider; }});
+        }
+    }
+
+    // reduced resolutions of the displayed images, only built once a view is zoomed out enough to use them
+    for (auto seq : gSequences) {
+        std::shared_ptr<ImagePyramid> pyramid = seq->image ? seq->image->pyramid : nullptr;
+        if (pyramid && !pyramid->isLoaded() && seq->view
+            && ImagePyramid::isUsedAt(seq->view->zoom * seq->getViewRescaleFactor())) {
+            requests.push_back(Request{"pyramid:" + std::to_string((size_t) pyramid.get()),
+                                       SleepyLoadingThreadPool::PYRAMIDS,
+                                       [pyramid]() { return pyramid; }});
+        }
+    }
+
+    // futur frames, following the direction and the bounds of the players
+    for (int i = 1; i < 100; i++) {
+        SleepyLoadingThreadPool::Priority priority = i <= upcoming ? SleepyLoadingThreadPool::UPCOMING
+                                                                   : SleepyLoadingThreadPool::PREFETCH;
+        if (priority == SleepyLoadingThreadPool::PREFETCH && ImageCache::isFull())
+            break;
+        for (auto seq : gSequences) {
+            Player* player = seq->player;
+            // the request keeps the collection alive if the sequence drops it meanwhile
+            std::shared_ptr<ImageCollection> collection = seq->collection;
+            if (!player || !collection || collection->getLength() == 0)
+                continue;
+            int lo = std::max(player->currentMinFrame, 1);
+            int hi = std::min(player->currentMaxFrame, collection->getLength());
+            if (lo > hi)
+                continue;
+            int frame = player->frame + (player->fps >= 0 ? i : -i);
+            if (player->looping) {
+                int span = hi - lo + 1;
+                frame = lo + ((frame - lo) % span + span) % span;
+            } else if (frame < lo || frame > hi) {
+                continue;
+            }
+            if (frame == player->frame)
+                continue;
+            std::string key = collection->getKey(frame - 1);
+            if (ImageCache::has(key) || ImageCache::Error::has(key))
+                continue;
+            requests.push_back(Request{key, priority, [collection, frame]() {
+                return collection->getImageProvider(frame - 1);
+            }});
+        }
+    }
+
+    // histograms
+    if (gShowHistogram) {
+        std::vector<std::shared_ptr<Histogram>> histograms;
+        for (auto w : gWindows) {
+            histograms.push_back(w->histogram);
+        }
+        for (auto seq : gSequences) {
+            if (seq->image)
+                histograms.push_back(seq->image->histogram);
+        }
+        for (auto h : histograms) {
+            if (h && !h->isLoaded()) {
+                requests.push_back(Request{"histogram:" + std::to_string((size_t) h.get()),
+                                           SleepyLoadingThreadPool::STATS,
+                                           [h]() { return h; }});
+            }
+        }
+    }
+
+    // region histograms and bounds of the displayed images
+    if (gShowHistogram || gSelectionShown) {
+        for (auto seq : gSequences) {
+            std::shared_ptr<HistogramIndex> index = seq->image ? seq->image->histogramIndex : nullptr;
+            if (index && !index->isLoaded()) {
+                requests.push_back(Request{"histogramindex:" + std::to_string((size_t) index.get()),
+                                           SleepyLoadingThreadPool::STATS,
+                                           [index]() { return index; }});
+            }
+        }
+    }
+
+    return requests;
+}
+
 #ifndef SDL
 sf::RenderWindow* SFMLWindow;
 #include <GL/glew.h>
@@ -412,9 +513,15 @@ int main(int argc, char* argv[])
     gShowImage = true;
     gDefaultFramerate = config::get_float("DEFAULT_FRAMERATE");
     gDownsamplingQuality = config::get_float("DOWNSAMPLING_QUALITY");
+    gUploadBudget = config::get_float("UPLOAD_BUDGET");
+    gTextureLimitMB = (float)config::get_lua()["toMB"](config::get_string("TEXTURE_LIMIT"));
     gCacheLimitMB = (float)config::get_lua()["toMB"](config::get_string("CACHE_LIMIT"));
+    if (config::get_string("CACHE_POLICY") == "playback") {
+        ImageCache::setEvictionPolicy(std::make_shared<PlaybackEvictionPolicy>());
+    }
     gPreload = config::get_bool("PRELOAD");
     gSmoothHistogram = config::get_bool("SMOOTH_HISTOGRAM");
+    gPreciseHistogram = config::get_bool("PRECISE_HISTOGRAM");
     gForceIioOpen = config::get_bool("FORCE_IIO_OPEN");
 
     parseLayout(config::get_string("DEFAULT_LAYOUT"));
@@ -434,56 +541,12 @@ int main(int argc, char* argv[])
 
     relayout(true);
 
-    SleepyLoadingThread iothread([]() -> std::shared_ptr<Progressable> {
-        // fill the queue with images to be displayed
-        for (auto seq : gSequences) {
-            std::shared_ptr<Progressable> provider = seq->imageprovider;
-            if (provider && !provider->isLoaded()) {
-                return provider;
-            }
-        }
-
-        if (!ImageCache::isFull()) {
-            // fill the queue with futur frames
-            for (int i = 1; i < 100; i++) {
-                for (auto seq : gSequences) {
-                    if (!seq->player)
-                        continue;
-                    ImageCollection* collection = seq->collection;
-                    if (!collection || collection->getLength() == 0)
-                        continue;
-                    int frame = (seq->player->frame + i - 1) % collection->getLength();
-                    if (frame == seq->player->frame - 1)
-                        continue;
-                    std::shared_ptr<ImageProvider> provider = collection->getImageProvider(frame);
-                    if (!provider->isLoaded()) {
-                        return provider;
-                    }
-                }
-            }
-        }
-        return nullptr;
-    });
-    iothread.start();
-
-    LoadingThread computethread([]() -> std::shared_ptr<Progressable> {
-        if (!gShowHistogram) return nullptr;
-        for (auto w : gWindows) {
-            std::shared_ptr<Progressable> provider = w->histogram;
-            if (provider && !provider->isLoaded()) {
-                return provider;
-            }
-        }
-        for (auto seq : gSequences) {
-            if (!seq->image) continue;
-            std::shared_ptr<Progressable> provider = seq->image->histogram;
-            if (provider && !provider->isLoaded()) {
-                return provider;
-            }
-        }
-        return nullptr;
-    });
-    computethread.start();
+    SleepyLoadingThreadPool iothreads;
+    int nthreads = config::get_int("LOADING_THREADS");
+    if (nthreads <= 0) {
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    iothreads.start(nthreads);
 
     if (gSequences.empty()) {
         showHelp = true;
@@ -538,15 +601,8 @@ int main(int argc, char* argv[])
 
         watcher_check();
 
-        for (auto seq : gSequences) {
-            std::shared_ptr<Progressable> provider = seq->imageprovider;
-            if (provider && !provider->isLoaded()) {
-                iothread.notify();
-            }
-        }
-        if (ImGui::GetFrameCount() % 60 == 0) {
-            iothread.notify();
-        }
+        ImageCache::updateEvictionPolicy();
+        iothreads.schedule(getLoadingRequests(iothreads.size()));
 
         if (gReloadImages) {
             gReloadImages = false;
@@ -608,6 +664,7 @@ int main(int argc, char* argv[])
         for (size_t i = 0; i < gWindows.size(); i++) {
             gWindows[i]->display();
         }
+        Texture::processUploads();
 
         for (auto seq : gSequences) {
             seq->tick();
@@ -711,10 +768,8 @@ int main(int argc, char* argv[])
         }
     }
 
-    iothread.stop();
-    // do not join the iothread as it can be slow to exit
-    computethread.stop();
-    computethread.join();
+    iothreads.stop();
+    // do not join the iothreads as they can be slow to exit
 
 #define CLEAR(tab) \
     for (auto s : tab) \
@@ -873,6 +928,8 @@ void help()
             "\nPRELOAD = true"
             "\nCACHE = true"
             "\nCACHE_LIMIT = '2GB'"
+            "\nCACHE_POLICY = 'playback'"
+            "\nLOADING_THREADS = 0"
             "\nSCREENSHOT = 'screenshot_%%d.png'"
             "\nWINDOW_WIDTH = 1024"
             "\nWINDOW_HEIGHT = 720"
@@ -888,7 +945,10 @@ void help()
             "\nSATURATIONS = {0.001, 0.01, 0.1}"
             "\nDEFAULT_FRAMERATE = 30.0"
             "\nDOWNSAMPLING_QUALITY = 1"
+            "\nUPLOAD_BUDGET = 4"
+            "\nTEXTURE_LIMIT = '1GB'"
             "\nSMOOTH_HISTOGRAM = false"
+            "\nPRECISE_HISTOGRAM = false"
             "\nSVG_OFFSET_X = 0"
             "\nSVG_OFFSET_Y = 0"
             "\nASYNC = false";